@@ -1,19 +1,112 @@
+#include "histogram.hpp"
 #include "lib.hpp"
 
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <chrono>
 #include <csignal>
 #include <iostream>
+#include <optional>
 #include <random>
+#include <string_view>
 #include <vector>
 
-socket_task client_loop(const char* port_no)
+// Load generator for the echo server. Each connection sends a length byte and that many random bytes, waits for
+// them to be echoed back and checks them. Closed loop by default (each connection sends its next request as soon
+// as it has the reply); with a target rate each connection sends on a fixed schedule instead, and latency is
+// measured from when a request was due rather than when it was sent, so a stalled server is charged for the
+// requests it held up (correcting for coordinated omission). A connection still only has one request in flight,
+// so the rate is only met with enough connections to cover the server's latency.
+
+using clock_type = std::chrono::steady_clock;
+
+// Payload sizes in bytes, the protocol limits them to 1-255
+struct payload_sizes {
+   enum class kind { fixed, uniform, exponential };
+
+   // Parses fixed:n, uniform:min:max or exponential:mean
+   static std::optional<payload_sizes> parse(std::string_view spec)
+   {
+      const auto colon = spec.find(':');
+      if (colon == std::string_view::npos) {
+         return std::nullopt;
+      }
+      const auto name = spec.substr(0, colon);
+      std::array<int, 2> values{};
+      std::size_t num_values = 0;
+      for (auto rest = spec.substr(colon + 1); num_values < values.size();) {
+         const auto [end, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), values[num_values]);
+         if (ec != std::errc{} || values[num_values] < 1 || values[num_values] > 255) {
+            return std::nullopt;
+         }
+         num_values += 1;
+         rest = rest.substr(end - rest.data());
+         if (rest.empty()) {
+            break;
+         }
+         if (rest.front() != ':') {
+            return std::nullopt;
+         }
+         rest.remove_prefix(1);
+      }
+      if (name == "fixed" && num_values == 1) {
+         return payload_sizes{kind::fixed, values[0], values[0]};
+      }
+      if (name == "uniform" && num_values == 2 && values[0] <= values[1]) {
+         return payload_sizes{kind::uniform, values[0], values[1]};
+      }
+      if (name == "exponential" && num_values == 1) {
+         return payload_sizes{kind::exponential, values[0], values[0]};
+      }
+      return std::nullopt;
+   }
+
+   unsigned char operator()(std::minstd_rand0& prng) const
+   {
+      switch (distribution) {
+      case kind::fixed:
+         return static_cast<unsigned char>(a);
+      case kind::uniform:
+         return static_cast<unsigned char>(std::uniform_int_distribution<int>{a, b}(prng));
+      case kind::exponential:
+         const auto size = std::exponential_distribution<double>{1.0 / a}(prng);
+         return static_cast<unsigned char>(std::clamp(static_cast<int>(size + 0.5), 1, 255));
+      }
+      return 1;
+   }
+
+   kind distribution = kind::uniform;
+   int a = 1;
+   int b = 100;
+};
+
+struct load_options {
+   const char* host = "localhost";
+   // Requests per second over all connections, 0 for closed loop
+   double rate = 0;
+   clock_type::duration warmup = std::chrono::seconds{1};
+   clock_type::duration duration = std::chrono::seconds{10};
+   payload_sizes sizes;
+};
+
+struct load_results {
+   // Round trip times in nanoseconds of requests due after the warmup
+   histogram latencies;
+   std::uint64_t failed_connections = 0;
+};
+
+socket_task client_loop(
+   const char* port_no, const load_options& options, clock_type::time_point start, int connection_index,
+   int num_connections, load_results& results)
 {
    std::minstd_rand0 prng{std::random_device{}()};
-   const auto res = co_await async_connect("localhost", port_no);
+   const auto res = co_await async_connect(options.host, port_no);
    if (!res) {
-      std::cerr << "Connect failed\n";
-      perror(nullptr);
+      // Negative errors are from the lookup
+      const auto error = res.error();
+      std::cerr << "Connect failed: " << (error < 0 ? gai_strerror(error) : std::strerror(error)) << '\n';
+      results.failed_connections += 1;
       co_return;
    }
 
@@ -21,54 +114,98 @@ socket_task client_loop(const char* port_no)
    int enable = 1;
    setsockopt(res.value(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
 
-   std::cout << "connected with " << res.value() << '\n';
+   const auto measure_from = start + options.warmup;
+   const auto stop_at = measure_from + options.duration;
+   // Each connection is due to send every interval, offset so the connections don't all send at once
+   const auto interval = options.rate > 0
+      ? std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>{num_connections / options.rate})
+      : clock_type::duration{};
+   auto due = start + interval * connection_index / num_connections;
 
+   buffered_reader reader{res.value()};
+   std::vector<char> to_write;
    while (true) {
-      // Generate a random amount of bytes to write
-      const auto start_time = std::chrono::steady_clock::now();
-      const char num_bytes_to_write = std::uniform_int_distribution<unsigned char>{1, 100}(prng);
-      const auto res2 = co_await async_write(res.value(), &num_bytes_to_write, 1);
-      if (!res2) {
-         std::cerr << "Write 1 failed\n";
+      if (options.rate > 0) {
+         // Timers have millisecond ticks, so wake up to a millisecond early rather than late
+         const auto wait = due - clock_type::now() - std::chrono::milliseconds{1};
+         if (wait > clock_type::duration{}) {
+            co_await async_sleep(wait);
+         }
+      }
+      const auto send_time = clock_type::now();
+      const auto request_start = options.rate > 0 ? std::min(due, send_time) : send_time;
+      if (request_start >= stop_at) {
          co_return;
       }
+      due += interval;
 
-      // Generate the random bytes to write
-      std::vector<char> to_write(num_bytes_to_write);
-      std::ranges::generate(to_write, [&]() { return prng(); });
-      const auto res3 = co_await async_write(res.value(), to_write.data(), to_write.size());
-      if (!res3) {
-         std::cerr << "Write 2 failed\n";
+      unsigned char num_bytes_to_write = options.sizes(prng);
+      to_write.resize(num_bytes_to_write);
+      std::ranges::generate(to_write, [&]() { return static_cast<char>(prng()); });
+
+      // Send the length and the bytes with a single syscall
+      std::array<iovec, 2> message{{{&num_bytes_to_write, 1}, {to_write.data(), to_write.size()}}};
+      const auto res2 = co_await async_writev(res.value(), message);
+      if (!res2) {
+         std::cerr << "Write failed\n";
          co_return;
       }
 
-      // Read them back and verify that they're the same
-      std::vector<char> read_bytes(num_bytes_to_write);
-      const auto res4 = co_await async_read(res.value(), read_bytes.data(), read_bytes.size());
-      if (!res4) {
+      const auto res3 = co_await reader.read_exact(num_bytes_to_write);
+      if (!res3) {
          std::cerr << "Read failed\n";
          co_return;
       }
-
-      const auto durr = std::chrono::steady_clock::now() - start_time;
-
-      if (read_bytes != to_write) {
+      if (!std::ranges::equal(res3.value(), to_write)) {
          std::cerr << "Round trip failed for socket " << res.value() << '\n';
          co_return;
       }
-      else {
-         std::cout << "Round trip OK for " << res.value() << ", took "
-                   << duration_cast<std::chrono::milliseconds>(durr).count() << "ms\n";
+      if (request_start >= measure_from) {
+         const auto latency = clock_type::now() - request_start;
+         results.latencies.record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
       }
    }
 }
 
+void print_results(const load_results& results, const load_options& options, int num_connections)
+{
+   const auto seconds = std::chrono::duration<double>{options.duration}.count();
+   const auto to_us = [](std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+   const auto& latencies = results.latencies;
+   std::cout << "connections " << num_connections << '\n';
+   std::cout << "failed_connections " << results.failed_connections << '\n';
+   std::cout << "target_rate_rps " << options.rate << '\n';
+   std::cout << "duration_s " << seconds << '\n';
+   std::cout << "requests " << latencies.count() << '\n';
+   std::cout << "throughput_rps " << static_cast<double>(latencies.count()) / seconds << '\n';
+   std::cout << "latency_mean_us " << latencies.mean() / 1000.0 << '\n';
+   std::cout << "latency_p50_us " << to_us(latencies.percentile(50)) << '\n';
+   std::cout << "latency_p90_us " << to_us(latencies.percentile(90)) << '\n';
+   std::cout << "latency_p99_us " << to_us(latencies.percentile(99)) << '\n';
+   std::cout << "latency_p99.9_us " << to_us(latencies.percentile(99.9)) << '\n';
+   std::cout << "latency_max_us " << to_us(latencies.max()) << '\n';
+   // The scheduler's own busy polling, from the start of the run including the warmup
+   for (const auto& stats : scheduler_stats::snapshot()) {
+      std::cout << "busy_polls " << stats.busy_polls << '\n';
+      std::cout << "busy_poll_hits " << stats.busy_poll_hits << '\n';
+      std::cout << "spin_ms " << static_cast<double>(stats.spin_ns) / 1e6 << '\n';
+      std::cout << "sleeps " << stats.sleeps << '\n';
+   }
+}
+
 int main(int argc, const char* argv[])
 {
    std::signal(SIGPIPE, SIG_IGN);
-   if (argc != 3) {
-      std::cerr << "Usage:\n" << argv[0] << " port_number num_connections\n";
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " port_number num_connections [--host name] [--hosts hosts_file] [--rate requests_per_second]"
+                   " [--warmup seconds] [--duration seconds] [--size fixed:n|uniform:min:max|exponential:mean]"
+                   " [--busy-poll usecs]\n";
       return 2;
+   };
+   if (argc < 3) {
+      return usage();
    }
 
    const auto port_no_test = std::atoi(argv[1]);
@@ -83,9 +220,73 @@ int main(int argc, const char* argv[])
       return 2;
    }
 
+   load_options options;
+   const auto parse_seconds = [](const char* arg) -> std::optional<clock_type::duration> {
+      const auto seconds = std::atof(arg);
+      if (seconds < 0) {
+         return std::nullopt;
+      }
+      return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>{seconds});
+   };
+   for (int i = 3; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (i + 1 == argc) {
+         return usage();
+      }
+      i += 1;
+      if (arg == "--host") {
+         options.host = argv[i];
+      }
+      else if (arg == "--hosts") {
+         // Resolve names from this file rather than the system's configuration
+         if (!resolver::instance().load_hosts_file(argv[i])) {
+            std::cerr << "Error reading hosts file\n";
+            return 2;
+         }
+      }
+      else if (arg == "--rate") {
+         options.rate = std::atof(argv[i]);
+         if (options.rate <= 0) {
+            std::cerr << "Error parsing rate\n";
+            return 2;
+         }
+      }
+      else if (arg == "--warmup" || arg == "--duration") {
+         const auto seconds = parse_seconds(argv[i]);
+         if (!seconds || (arg == "--duration" && *seconds == clock_type::duration{})) {
+            std::cerr << "Error parsing " << arg << '\n';
+            return 2;
+         }
+         (arg == "--warmup" ? options.warmup : options.duration) = *seconds;
+      }
+      else if (arg == "--size") {
+         const auto sizes = payload_sizes::parse(argv[i]);
+         if (!sizes) {
+            std::cerr << "Error parsing payload sizes, they must be from 1 to 255\n";
+            return 2;
+         }
+         options.sizes = *sizes;
+      }
+      else if (arg == "--busy-poll") {
+         // Spin this long before blocking, which takes the wakeup out of the latencies measured
+         const auto usecs = std::atoi(argv[i]);
+         if (usecs < 0) {
+            std::cerr << "Error parsing busy poll time\n";
+            return 2;
+         }
+         busy_poll_budget::this_thread() = std::chrono::microseconds{usecs};
+      }
+      else {
+         return usage();
+      }
+   }
+
+   load_results results;
+   const auto start = clock_type::now();
    std::vector<socket_task> tasks;
    for (int i = 0; i < num_conns; ++i) {
-      tasks.emplace_back(client_loop(argv[1]));
+      tasks.emplace_back(client_loop(argv[1], options, start, i, num_conns, results));
    }
    socket_scheduler(tasks);
+   print_results(results, options, num_conns);
 }
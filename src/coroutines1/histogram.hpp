@@ -0,0 +1,128 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+// A counter that only one thread changes but any thread can read. Updates are a relaxed load and store rather
+// than an atomic read-modify-write, so they cost the same as a plain increment on x86.
+class single_writer_counter {
+public:
+   single_writer_counter(std::uint64_t value = 0) noexcept : value_{value} {}
+
+   single_writer_counter& operator=(std::uint64_t value) noexcept
+   {
+      value_.store(value, std::memory_order_relaxed);
+      return *this;
+   }
+
+   single_writer_counter& operator+=(std::uint64_t n) noexcept
+   { return *this = value_.load(std::memory_order_relaxed) + n; }
+
+   single_writer_counter& operator-=(std::uint64_t n) noexcept
+   { return *this = value_.load(std::memory_order_relaxed) - n; }
+
+   operator std::uint64_t() const noexcept { return value_.load(std::memory_order_relaxed); }
+
+private:
+   std::atomic<std::uint64_t> value_;
+};
+
+// Log-linear histogram of 64-bit values in the style of HdrHistogram: values below 256 are counted exactly, above
+// that each power of two range is split into 128 buckets, so a reported value is never more than 0.8% above the
+// value recorded. Buckets only go up to 2^36, about 69 seconds in nanoseconds, and larger values all share the
+// last one, though max() is still exact. That keeps a histogram to 3840 counters, 30KB, as each scheduler thread
+// has several. Recording is a couple of shifts and an increment with no allocation, and histograms from several
+// threads can be merged. Counter is std::uint64_t, or single_writer_counter for a histogram that one
+// thread records into while others merge it into their own.
+template<typename Counter>
+class basic_histogram {
+public:
+   void record(std::uint64_t value, std::uint64_t count = 1) noexcept
+   {
+      static_assert(bucket_index(max_trackable) == num_buckets - 1);
+      counts_[bucket_index(std::min(value, max_trackable))] += count;
+      total_count_ += count;
+      min_ = std::min<std::uint64_t>(min_, value);
+      max_ = std::max<std::uint64_t>(max_, value);
+      sum_ += value * count;
+   }
+
+   template<typename OtherCounter>
+   void merge(const basic_histogram<OtherCounter>& other) noexcept
+   {
+      for (std::size_t i = 0; i < num_buckets; ++i) {
+         counts_[i] += other.counts_[i];
+      }
+      total_count_ += other.total_count_;
+      min_ = std::min<std::uint64_t>(min_, other.min_);
+      max_ = std::max<std::uint64_t>(max_, other.max_);
+      sum_ += other.sum_;
+   }
+
+   void reset() noexcept { *this = basic_histogram{}; }
+
+   std::uint64_t count() const noexcept { return total_count_; }
+   std::uint64_t min() const noexcept { return total_count_ == 0 ? 0 : min_; }
+   std::uint64_t max() const noexcept { return max_; }
+   double mean() const noexcept
+   { return total_count_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(total_count_); }
+
+   // Smallest value that percentile percent of the recorded values are at or below, to within the bucket width
+   std::uint64_t percentile(double percent) const noexcept
+   {
+      if (total_count_ == 0) {
+         return 0;
+      }
+      const auto rank = static_cast<std::uint64_t>(std::ceil(percent / 100.0 * static_cast<double>(total_count_)));
+      const auto wanted = std::clamp<std::uint64_t>(rank, 1, total_count_);
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < num_buckets; ++i) {
+         seen += counts_[i];
+         if (seen >= wanted) {
+            return std::min<std::uint64_t>(bucket_highest(i), max_);
+         }
+      }
+      return max_;
+   }
+
+private:
+   static constexpr int sub_bucket_bits = 7;
+   static constexpr std::uint64_t sub_bucket_count = std::uint64_t{1} << sub_bucket_bits;
+   static constexpr int max_value_bits = 36;
+   static constexpr std::uint64_t max_trackable = (std::uint64_t{1} << max_value_bits) - 1;
+   // Values of up to 2 * sub_bucket_count have a bucket each, every doubling after that adds sub_bucket_count
+   static constexpr std::size_t num_buckets = (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+   static constexpr std::size_t bucket_index(std::uint64_t value) noexcept
+   {
+      const int shift = std::max(0, static_cast<int>(std::bit_width(value)) - (sub_bucket_bits + 1));
+      return static_cast<std::size_t>(shift) * sub_bucket_count + (value >> shift);
+   }
+
+   static constexpr std::uint64_t bucket_highest(std::size_t index) noexcept
+   {
+      const auto shift = index < 2 * sub_bucket_count ? 0 : index / sub_bucket_count - 1;
+      const auto lowest = (index - shift * sub_bucket_count) << shift;
+      return lowest + ((std::uint64_t{1} << shift) - 1);
+   }
+
+   template<typename>
+   friend class basic_histogram;
+
+   std::array<Counter, num_buckets> counts_{};
+   Counter total_count_ = 0;
+   Counter min_ = std::numeric_limits<std::uint64_t>::max();
+   Counter max_ = 0;
+   Counter sum_ = 0;
+};
+
+using histogram = basic_histogram<std::uint64_t>;
+using shared_histogram = basic_histogram<single_writer_counter>;
+
+#endif // HISTOGRAM_HPP
@@ -0,0 +1,90 @@
+#include "lib.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Several threads post tasks into a running socket_scheduler while one of its tasks offloads work to other threads
+// and waits for the results. Every posted task must run on the scheduler's thread, each thread's in the order they
+// were posted, and every offload must run its work elsewhere and come back to the scheduler's thread with the
+// right result. Exits with 1 otherwise. Meant to be run under TSan as well.
+
+constexpr int num_posters = 4;
+constexpr int posts_per_thread = 20'000;
+constexpr int num_offloads = 600;
+
+[[noreturn]] void fail(const char* message)
+{
+   std::cerr << message << '\n';
+   std::exit(1);
+}
+
+struct test_state {
+   std::thread::id scheduler_thread = std::this_thread::get_id();
+   // Only touched on the scheduler's thread, so TSan flags any task that runs elsewhere
+   std::array<int, num_posters> next_sequence{};
+   int posted_run = 0;
+};
+
+socket_task posted(test_state& state, int poster, int sequence)
+{
+   if (std::this_thread::get_id() != state.scheduler_thread) {
+      fail("A posted task ran on another thread");
+   }
+   if (sequence != state.next_sequence[poster]) {
+      fail("Posted tasks ran out of order");
+   }
+   state.next_sequence[poster] += 1;
+   // Suspend once so the task is run through the scheduler too
+   co_await yield();
+   state.posted_run += 1;
+}
+
+socket_task offloader(test_state& state)
+{
+   const auto queue = injection_queue::this_thread();
+   std::vector<std::jthread> posters;
+   for (int p = 0; p < num_posters; ++p) {
+      posters.emplace_back([&state, queue, p]() {
+         for (int i = 0; i < posts_per_thread; ++i) {
+            queue->post([&state, p, i]() { return posted(state, p, i); });
+         }
+      });
+   }
+
+   const auto submit = [](auto job) { std::thread{std::move(job)}.detach(); };
+   for (std::uint64_t i = 0; i < num_offloads; ++i) {
+      const auto result = co_await async_offload(submit, [&state, i]() {
+         if (std::this_thread::get_id() == state.scheduler_thread) {
+            fail("Offloaded work ran on the scheduler's thread");
+         }
+         return i * i;
+      });
+      if (result != i * i || std::this_thread::get_id() != state.scheduler_thread) {
+         fail("An offload came back wrong");
+      }
+   }
+
+   // Everything posted is queued before this resumes, and posted tasks run up to their yield as they're created
+   co_await async_offload(submit, [&posters]() { posters.clear(); });
+   for (int p = 0; p < num_posters; ++p) {
+      if (state.next_sequence[p] != posts_per_thread) {
+         fail("Not every posted task was started");
+      }
+   }
+}
+
+int main()
+{
+   test_state state;
+   std::vector<socket_task> tasks;
+   tasks.push_back(offloader(state));
+   socket_scheduler(tasks);
+   if (state.posted_run != num_posters * posts_per_thread) {
+      fail("Not every posted task finished");
+   }
+   std::cout << "Ran " << state.posted_run << " posted tasks and " << num_offloads << " offloads\n";
+}
@@ -1,24 +1,253 @@
 #ifndef COROUTINE_LIB_HPP
 #define COROUTINE_LIB_HPP
 
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef COROUTINES1_IO_URING
+   #include <linux/io_uring.h>
+   #include <sys/mman.h>
+   #include <sys/syscall.h>
+#endif
+
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <coroutine>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <expected>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <source_location>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "histogram.hpp"
+#include "work_stealing_deque.hpp"
+
+// Frame size and number of frames allocated for each coroutine function, for sizing frame pools and working out
+// the memory used per connection. Shared by all threads.
+class frame_stats {
+public:
+   struct entry {
+      // As given by std::source_location::function_name
+      const char* function;
+      std::size_t frame_size;
+      std::uint64_t allocations;
+   };
+
+   // Returns the entry to count allocations of function against, creating it on first use
+   static std::atomic<std::uint64_t>& counter_for(const char* function, std::size_t frame_size)
+   {
+      thread_local std::vector<std::pair<const char*, record*>> cache;
+      for (const auto& [name, rec] : cache) {
+         if (name == function) {
+            return rec->allocations;
+         }
+      }
+      auto& self = instance();
+      const std::lock_guard lock{self.mutex_};
+      // The same function can have a different name pointer in each translation unit
+      auto it = std::ranges::find_if(
+         self.records_, [&](const auto& rec) { return std::strcmp(rec->function, function) == 0; });
+      if (it == self.records_.end()) {
+         self.records_.push_back(std::make_unique<record>(function, frame_size));
+         it = std::prev(self.records_.end());
+      }
+      cache.emplace_back(function, it->get());
+      return (*it)->allocations;
+   }
+
+   static std::vector<entry> snapshot()
+   {
+      auto& self = instance();
+      const std::lock_guard lock{self.mutex_};
+      std::vector<entry> entries;
+      for (const auto& rec : self.records_) {
+         entries.push_back({rec->function, rec->frame_size, rec->allocations.load(std::memory_order_relaxed)});
+      }
+      return entries;
+   }
+
+private:
+   struct record {
+      record(const char* function, std::size_t frame_size) : function{function}, frame_size{frame_size} {}
+
+      const char* function;
+      std::size_t frame_size;
+      std::atomic<std::uint64_t> allocations{0};
+   };
+
+   static frame_stats& instance() noexcept
+   {
+      static frame_stats stats;
+      return stats;
+   }
+
+   std::mutex mutex_;
+   std::vector<std::unique_ptr<record>> records_;
+};
+
+// Per-thread free lists of coroutine frames in 64 byte size classes. Frames bigger than the largest class go
+// straight to the global allocator. A frame freed on a different thread from the one that allocated it (which
+// happens with work_stealing_scheduler) joins the freeing thread's lists; every block comes from the global
+// allocator with its class size, so it doesn't matter which pool gives it back.
+class frame_pool {
+public:
+   static constexpr std::size_t granularity = 64;
+   static constexpr std::size_t max_pooled_size = 4096;
+   // Frames of one size kept for reuse per thread, the rest are returned to the global allocator
+   static constexpr std::size_t max_cached_per_class = 4096;
+
+   static frame_pool& this_thread() noexcept
+   {
+      thread_local frame_pool pool;
+      return pool;
+   }
+
+   frame_pool(const frame_pool&) = delete;
+   frame_pool& operator=(const frame_pool&) = delete;
+
+   ~frame_pool()
+   {
+      for (std::size_t i = 0; i < num_classes; ++i) {
+         while (free_[i] != nullptr) {
+            ::operator delete(std::exchange(free_[i], free_[i]->next), class_size(i));
+         }
+      }
+   }
+
+   void* allocate(std::size_t size)
+   {
+      if (size > max_pooled_size) {
+         return ::operator new(size);
+      }
+      const auto i = class_index(size);
+      if (free_[i] == nullptr) {
+         misses_ += 1;
+         return ::operator new(class_size(i));
+      }
+      hits_ += 1;
+      num_free_[i] -= 1;
+      return std::exchange(free_[i], free_[i]->next);
+   }
+
+   void deallocate(void* ptr, std::size_t size) noexcept
+   {
+      if (size > max_pooled_size) {
+         ::operator delete(ptr, size);
+         return;
+      }
+      const auto i = class_index(size);
+      if (num_free_[i] == max_cached_per_class) {
+         ::operator delete(ptr, class_size(i));
+         return;
+      }
+      free_[i] = ::new (ptr) free_block{free_[i]};
+      num_free_[i] += 1;
+   }
+
+   // Fills the free list for frames of size bytes up to count frames, so the first connections don't have to go
+   // to the global allocator. Use frame_stats to find the sizes.
+   void reserve(std::size_t size, std::size_t count)
+   {
+      if (size > max_pooled_size) {
+         return;
+      }
+      const auto i = class_index(size);
+      count = std::min(count, max_cached_per_class);
+      while (num_free_[i] < count) {
+         free_[i] = ::new (::operator new(class_size(i))) free_block{free_[i]};
+         num_free_[i] += 1;
+      }
+   }
+
+   // Allocations served from the free lists and from the global allocator
+   std::uint64_t hits() const noexcept { return hits_; }
+   std::uint64_t misses() const noexcept { return misses_; }
+
+private:
+   struct free_block {
+      free_block* next;
+   };
+
+   static constexpr std::size_t num_classes = max_pooled_size / granularity;
+
+   static constexpr std::size_t class_index(std::size_t size) noexcept
+   { return size == 0 ? 0 : (size - 1) / granularity; }
+
+   static constexpr std::size_t class_size(std::size_t index) noexcept { return (index + 1) * granularity; }
+
+   frame_pool() = default;
+
+   std::array<free_block*, num_classes> free_{};
+   std::array<std::size_t, num_classes> num_free_{};
+   std::uint64_t hits_ = 0;
+   std::uint64_t misses_ = 0;
+};
+
+struct pooled_frame_allocator {
+   static void* allocate(std::size_t size) { return frame_pool::this_thread().allocate(size); }
+   static void deallocate(void* ptr, std::size_t size) noexcept { frame_pool::this_thread().deallocate(ptr, size); }
+};
+
+struct global_frame_allocator {
+   static void* allocate(std::size_t size) { return ::operator new(size); }
+   static void deallocate(void* ptr, std::size_t size) noexcept { ::operator delete(ptr, size); }
+};
+
+// Allocator for socket_task frames, any type with the same static members as pooled_frame_allocator. Define as
+// global_frame_allocator to compare against the global allocator.
+#ifndef COROUTINES1_FRAME_ALLOCATOR
+   #define COROUTINES1_FRAME_ALLOCATOR pooled_frame_allocator
+#endif
+
+// Base for promise types, allocates the coroutine frame with COROUTINES1_FRAME_ALLOCATOR
+struct pooled_frame {
+   // The default argument is evaluated in the coroutine, so loc names the coroutine function
+   static void* operator new(std::size_t size, std::source_location loc = std::source_location::current())
+   {
+      frame_stats::counter_for(loc.function_name(), size).fetch_add(1, std::memory_order_relaxed);
+      return COROUTINES1_FRAME_ALLOCATOR::allocate(size);
+   }
+
+   static void operator delete(void* ptr, std::size_t size) noexcept
+   { COROUTINES1_FRAME_ALLOCATOR::deallocate(ptr, size); }
+};
+
+template<typename Awaiter>
+struct budgeted_awaiter;
+
 struct socket_task {
    struct promise_type;
 
@@ -27,21 +256,53 @@ struct socket_task {
    struct socket_info {
       short events_to_test = 0;
       int handle = -1;
+      // If set, called with on_ready_context when the socket is ready and the task is only resumed if it returns
+      // true, which lets an awaiter that needs several reads or writes finish without a trip through the task
+      bool (*on_ready)(void*) noexcept = nullptr;
+      void* on_ready_context = nullptr;
    };
 
-   struct promise_type {
+   struct promise_type : pooled_frame {
       // std::exception_ptr exception_;
       socket_info sock_info_;
+      // Position in the scheduler's task vector, maintained by the scheduler so finished tasks can be removed
+      // without scanning every task
+      std::size_t task_index_ = 0;
+      // Worker that owns the task when it's run by work_stealing_scheduler
+      unsigned home_worker_ = 0;
+      // When work_stealing_scheduler found the task ready, for scheduler_stats. Pushing the task onto a deque
+      // orders this store before the thief's load, it's only atomic because thread sanitizers can't see that.
+      std::atomic<std::chrono::steady_clock::time_point> ready_since_{};
+      // Innermost coroutine to resume when the task is ready: the task itself, or the task<T> it's awaiting
+      // (possibly through other task<T>s)
+      std::coroutine_handle<> leaf_;
 
       void return_void() noexcept {}
 
       socket_task get_return_object() noexcept
-      { return socket_task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+      {
+         const auto h = std::coroutine_handle<promise_type>::from_promise(*this);
+         leaf_ = h;
+         return socket_task{h};
+      }
 
       std::suspend_never initial_suspend() noexcept { return {}; }
       std::suspend_always final_suspend() noexcept { return {}; }
 
       void unhandled_exception() noexcept {}
+
+      // Charges awaiters to the thread's yield_budget; anything that isn't an awaiter itself (like task<T>) is
+      // awaited as it is
+      template<typename Awaitable>
+      decltype(auto) await_transform(Awaitable&& awaitable) noexcept
+      {
+         if constexpr (requires { awaitable.await_ready(); }) {
+            return budgeted_awaiter<Awaitable>{std::forward<Awaitable>(awaitable)};
+         }
+         else {
+            return std::forward<Awaitable>(awaitable);
+         }
+      }
    };
 
    socket_task(socket_task&) = delete;
@@ -51,21 +312,14 @@ struct socket_task {
    socket_task& operator=(socket_task&& other) noexcept
    {
       if (this != &other) {
+         destroy();
          handle_ = other.handle_;
          other.handle_ = nullptr;
       }
       return *this;
    }
 
-   ~socket_task()
-   {
-      if (handle_) {
-         if (handle_.promise().sock_info_.handle != -1) {
-            close(handle_.promise().sock_info_.handle);
-         }
-         handle_.destroy();
-      }
-   }
+   ~socket_task() { destroy(); }
 
    socket_info get_sock_info() const noexcept
    {
@@ -76,7 +330,7 @@ struct socket_task {
    void resume() noexcept
    {
       assert(handle_ && !handle_.done());
-      handle_.resume();
+      handle_.promise().leaf_.resume();
    }
 
    bool done() const noexcept
@@ -87,248 +341,3674 @@ struct socket_task {
       return true;
    }
 
+   handle_type handle() const noexcept { return handle_; }
+
 private:
    explicit socket_task(handle_type h) noexcept : handle_{h} {}
 
+   void destroy() noexcept
+   {
+      if (handle_) {
+         if (handle_.promise().sock_info_.handle != -1) {
+            close(handle_.promise().sock_info_.handle);
+         }
+         handle_.destroy();
+      }
+   }
+
    handle_type handle_;
 };
 
-auto async_connect(const char* addr, const char* port) noexcept
-{
-   struct connect_awaiter {
-      bool await_ready() noexcept
-      {
-         addrinfo hints;
-         std::memset(&hints, 0, sizeof(hints));
-         // only check IPv4 addresses - AF_UNSPEC can cause an IPv6 address as the first address and
-         // the server is only IPv4
-         hints.ai_family = AF_INET;
-         hints.ai_socktype = SOCK_STREAM;
-         hints.ai_protocol = IPPROTO_IP;
-         addrinfo* result;
-         const auto resaddr = getaddrinfo(addr, port, &hints, &result);
-         if (resaddr != 0) {
-            err = resaddr;
-            return true;
-         }
-         else {
-            // Only try connecting with the first address, doing multiple would require
-            // much more complicated code and probably another layer of coroutines
-            for (auto ptr = result; ptr; ptr = ptr->ai_next) {
-               sock_handle = socket(ptr->ai_family, ptr->ai_socktype | SOCK_NONBLOCK, ptr->ai_protocol);
-               if (sock_handle == -1) {
-                  err = errno;
-                  continue;
-               }
-               const auto res = connect(sock_handle, ptr->ai_addr, ptr->ai_addrlen);
-               if (res == -1) {
-                  if (errno != EINPROGRESS) {
-                     // Some unexpected error occurred, try the next address
-                     close(sock_handle);
-                     err = errno;
-                     continue;
-                  }
-                  // We're waiting on the connection, can't resume yet
-                  freeaddrinfo(result);
-                  return false;
-               }
-               // We connected without error, so we can resume right away
-               freeaddrinfo(result);
-               return true;
-            }
-            // if we reach here it means it errored so we can resume right away
-            freeaddrinfo(result);
-            return true;
-         }
-      }
+template<typename T>
+struct task_result {
+   template<typename U = T>
+   void return_value(U&& value)
+   { value_.emplace(std::forward<U>(value)); }
 
-      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
-      { h.promise().sock_info_ = {POLLOUT, sock_handle}; }
+   std::optional<T> value_;
+};
 
-      std::expected<int, int> await_resume() noexcept
-      {
-         if (err == 0) {
-            socklen_t errsize = sizeof(err);
-            getsockopt(sock_handle, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &errsize);
-         }
-         if (err == 0) {
-            return sock_handle;
-         }
-         return std::unexpected(err);
-      }
+template<>
+struct task_result<void> {
+   void return_void() noexcept {}
+};
 
-      int sock_handle;
-      int err;
-      const char* addr;
-      const char* port;
-   };
-   return connect_awaiter{-1, 0, addr, port};
-}
+// What task<T>'s promise has in common whatever T is
+struct task_promise_base : pooled_frame {
+   // The socket_task at the end of the chain of awaiting coroutines, which is what the scheduler knows about
+   socket_task::handle_type root_;
+   std::coroutine_handle<> continuation_;
+   std::exception_ptr exception_;
+   // Set while the task is being run from inside co_await, which carries on by itself if the task finishes
+   bool running_inline_ = false;
 
-auto async_read(int sock_handle, char* buffer, std::size_t buf_size) noexcept
-{
-   struct read_awaiter {
-      bool await_ready() noexcept { return try_read(); }
+   // Gives the socket awaiters the root task's handle, they keep their state in its sock_info_
+   template<typename Awaiter>
+   struct root_awaiter {
+      bool await_ready() { return inner.await_ready(); }
 
-      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
-      { h.promise().sock_info_ = {POLLIN, sock_handle}; }
+      template<typename Promise>
+      auto await_suspend(std::coroutine_handle<Promise> h)
+      { return inner.await_suspend(h.promise().root_); }
 
-      std::expected<int, int> await_resume() noexcept
-      {
-         if (!read_done) {
-            const bool result = try_read();
-            assert(result);
-            (void)result;
-         }
-         if (err == 0) {
-            return num_bytes_read;
-         }
-         return std::unexpected(err);
-      }
+      decltype(auto) await_resume() { return inner.await_resume(); }
 
-      bool try_read() noexcept
+      Awaiter inner;
+   };
+
+   struct final_awaiter {
+      bool await_ready() noexcept { return false; }
+
+      template<typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
       {
-         num_bytes_read = read(sock_handle, buffer, buf_size);
-         if (num_bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            err = errno;
-            read_done = true;
-            return true;
+         auto& promise = h.promise();
+         promise.root_.promise().leaf_ = promise.continuation_;
+         if (promise.running_inline_) {
+            return std::noop_coroutine();
          }
-         read_done = num_bytes_read >= 0;
-         return read_done;
+         return promise.continuation_;
       }
 
-      bool read_done;
-      int sock_handle;
-      int err;
-      int num_bytes_read;
-      std::size_t buf_size;
-      char* buffer;
+      void await_resume() noexcept {}
    };
 
-   return read_awaiter{false, sock_handle, 0, 0, buf_size, buffer};
-}
-
-auto async_write(int sock_handle, const char* buffer, std::size_t buf_size) noexcept
-{
-   struct write_awaiter {
-      bool await_ready() noexcept { return try_write(); }
+   std::suspend_always initial_suspend() noexcept { return {}; }
+   final_awaiter final_suspend() noexcept { return {}; }
 
-      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
-      { h.promise().sock_info_ = {POLLOUT, sock_handle}; }
+   void unhandled_exception() noexcept { exception_ = std::current_exception(); }
 
-      std::expected<int, int> await_resume() noexcept
-      {
-         if (!write_done) {
-            const auto result = try_write();
-            assert(result);
-            (void)result;
-         }
-         if (err == 0) {
-            return num_bytes_written;
-         }
-         return std::unexpected(err);
+   // Awaiters that only take a socket_task handle are wrapped, and charged to the yield_budget like they are in a
+   // socket_task; anything else is awaited as it is
+   template<typename Awaitable>
+   decltype(auto) await_transform(Awaitable&& awaitable) noexcept
+   {
+      if constexpr (
+         requires { awaitable.await_suspend(std::declval<socket_task::handle_type>()); }
+         && !requires { awaitable.await_suspend(std::declval<std::coroutine_handle<>>()); }) {
+         return budgeted_awaiter<root_awaiter<Awaitable>>{{std::forward<Awaitable>(awaitable)}};
       }
-
-      bool try_write() noexcept
-      {
-         num_bytes_written = write(sock_handle, buffer, buf_size);
-         if (num_bytes_written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            err = errno;
-            write_done = true;
-            return true;
-         }
-         write_done = num_bytes_written >= 0;
-         return write_done;
+      else {
+         return std::forward<Awaitable>(awaitable);
       }
+   }
+};
 
-      bool write_done;
-      int sock_handle;
-      int err;
-      int num_bytes_written;
-      std::size_t buf_size;
-      const char* buffer;
+// A lazily started coroutine that produces a T, for splitting a protocol into smaller coroutines without giving
+// each one to the scheduler. co_await it from a socket_task or another task: it starts running straight away, and
+// if it has to wait for a socket it resumes the awaiting coroutine directly when it finishes (symmetric transfer),
+// so there's no trip through the scheduler either way. While it waits the scheduler sees the outermost socket_task
+// waiting, and resumes this task when the socket is ready. Exceptions are rethrown by co_await.
+template<typename T = void>
+class task {
+public:
+   struct promise_type : task_promise_base, task_result<T> {
+      task get_return_object() noexcept { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
    };
 
-   return write_awaiter{false, sock_handle, 0, 0, buf_size, buffer};
-}
+   using handle_type = std::coroutine_handle<promise_type>;
 
-auto async_accept(int sock_handle) noexcept
-{
-   struct accept_awaiter {
-      bool await_ready() noexcept { return try_accept(); }
+   task(task&& other) noexcept : handle_{std::exchange(other.handle_, nullptr)} {}
 
-      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
-      { h.promise().sock_info_ = {POLLIN, sock_handle}; }
+   task& operator=(task&& other) noexcept
+   {
+      if (this != &other) {
+         destroy();
+         handle_ = std::exchange(other.handle_, nullptr);
+      }
+      return *this;
+   }
 
-      std::expected<int, int> await_resume() noexcept
+   ~task() { destroy(); }
+
+   auto operator co_await() && noexcept
+   {
+      assert(handle_ && !handle_.done());
+      return awaiter{handle_};
+   }
+
+private:
+   struct awaiter {
+      bool await_ready() noexcept { return false; }
+
+      // Runs the task straight away. If it finishes without waiting the awaiting coroutine doesn't suspend,
+      // otherwise the task resumes it by symmetric transfer when it does finish. Never starting the task with
+      // symmetric transfer means a loop awaiting tasks that don't wait doesn't grow the stack even when the
+      // compiler doesn't turn the transfer into a tail call (GCC doesn't without optimisation).
+      template<typename Promise>
+      bool await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
       {
-         if (!accept_done) {
-            const auto result = try_accept();
-            assert(result);
-            (void)result;
+         auto& promise = h.promise();
+         promise.continuation_ = awaiting;
+         if constexpr (std::is_same_v<Promise, socket_task::promise_type>) {
+            promise.root_ = awaiting;
          }
-         if (err == 0) {
-            return new_socket_handle;
+         else {
+            promise.root_ = awaiting.promise().root_;
          }
-         return std::unexpected(err);
+         promise.root_.promise().leaf_ = h;
+         promise.running_inline_ = true;
+         h.resume();
+         promise.running_inline_ = false;
+         return !h.done();
       }
 
-      bool try_accept() noexcept
+      T await_resume()
       {
-         new_socket_handle = accept(sock_handle, nullptr, nullptr);
-         if (new_socket_handle < 0 && (errno != EAGAIN || errno != EWOULDBLOCK)) {
-            err = errno;
-            accept_done = true;
-            return true;
+         auto& promise = h.promise();
+         if (promise.exception_) {
+            std::rethrow_exception(promise.exception_);
          }
-         accept_done = new_socket_handle >= 0;
-         if (accept_done) {
-            // set non-blocking
-            const int flags = fcntl(new_socket_handle, F_GETFL, 0);
-            fcntl(new_socket_handle, F_SETFL, flags | O_NONBLOCK);
+         if constexpr (!std::is_void_v<T>) {
+            return std::move(*promise.value_);
          }
-         return accept_done;
       }
 
-      bool accept_done;
-      int sock_handle;
-      int new_socket_handle;
-      int err;
+      handle_type h;
    };
 
-   return accept_awaiter{false, sock_handle, -1, 0};
-}
+   explicit task(handle_type h) noexcept : handle_{h} {}
 
-inline void socket_scheduler(std::vector<socket_task>& tasks) noexcept
-{
-   while (!tasks.empty()) {
-      std::vector<pollfd> poll_infos;
-      bool should_poll = false;
-      for (const auto& task : tasks) {
-         const auto info = task.get_sock_info();
-         pollfd poll_info;
-         poll_info.fd = info.handle;
-         poll_info.events = info.events_to_test;
-         if (info.events_to_test != 0) {
-            should_poll = true;
-         }
-         poll_infos.push_back(poll_info);
-      }
-      if (should_poll) {
-         poll(poll_infos.data(), poll_infos.size(), -1);
-         for (std::size_t i = 0; i < poll_infos.size(); ++i) {
-            const auto& poll_info = poll_infos[i];
-            const auto info = tasks[i].get_sock_info();
-            if (
-               (poll_info.revents & info.events_to_test) != 0 || (poll_info.revents & POLLERR) != 0
-               || (poll_info.revents & POLLHUP) != 0 || (poll_info.revents & POLLNVAL) != 0) {
-               tasks[i].resume();
-            }
-         }
+   void destroy() noexcept
+   {
+      if (handle_) {
+         handle_.destroy();
+      }
+   }
+
+   handle_type handle_;
+};
+
+// An intrusive timer, usually embedded in an awaiter. Must not be moved while armed.
+struct timer_node {
+   timer_node* prev = nullptr;
+   timer_node* next = nullptr;
+   std::uint64_t expiry = 0;
+   // Task resumed when the timer expires
+   socket_task::handle_type task;
+   // If set, called on expiry and the task is only resumed if it returns true
+   bool (*on_expire)(timer_node&) noexcept = nullptr;
+   bool expired = false;
+};
+
+// Hierarchical timer wheel (4 levels of 64 slots with 1ms ticks, so about 4.6 hours before a timer has to be
+// cascaded more than once). Arming and cancelling are O(1) list operations; timers only move between levels as
+// the wheel reaches them. One per thread, driven by the reactor running on that thread.
+class timer_wheel {
+public:
+   using clock = std::chrono::steady_clock;
+
+   static timer_wheel& this_thread() noexcept
+   {
+      thread_local timer_wheel wheel;
+      return wheel;
+   }
+
+   timer_wheel(const timer_wheel&) = delete;
+   timer_wheel& operator=(const timer_wheel&) = delete;
+
+   void arm(timer_node& node, clock::duration after) noexcept
+   {
+      assert(node.prev == nullptr);
+      node.expiry = std::max(current_tick_ + 1, ticks_until(clock::now() + after));
+      node.expired = false;
+      insert(node);
+      num_timers_ += 1;
+   }
+
+   // Does nothing if the timer isn't armed
+   void cancel(timer_node& node) noexcept
+   {
+      if (node.prev != nullptr) {
+         unlink(node);
+         num_timers_ -= 1;
+      }
+   }
+
+   bool empty() const noexcept { return num_timers_ == 0; }
+
+   // Time until the next timer could expire, if there are any. Waiting in whole milliseconds would make timers up
+   // to a millisecond later than the tick they expire on, so this is meant to be converted with to_timespec.
+   std::optional<clock::duration> next_timeout() const noexcept
+   {
+      if (num_timers_ == 0) {
+         return std::nullopt;
+      }
+      const auto now = clock::now();
+      if (ticks_elapsed(now) > current_tick_) {
+         return clock::duration{};
+      }
+      // Only look to the end of the current run of level 0 slots, later timers may still need to be cascaded
+      auto wake_tick = (current_tick_ | (slots_per_level - 1)) + 1;
+      for (auto tick = current_tick_ + 1; tick < wake_tick; ++tick) {
+         const auto& slot = wheel_[0][tick & (slots_per_level - 1)];
+         if (slot.next != &slot) {
+            wake_tick = tick;
+            break;
+         }
+      }
+      // wake_tick starts after the current tick, so this can't be negative
+      return std::chrono::duration_cast<clock::duration>(start_ + wake_tick * tick_length - now);
+   }
+
+   // Moves the wheel up to the current time, adding the tasks of expired timers to ready
+   void expire(std::vector<socket_task::handle_type>& ready) noexcept
+   {
+      const auto now_tick = ticks_elapsed(clock::now());
+      while (current_tick_ < now_tick) {
+         if (num_timers_ == 0) {
+            // Nothing to cascade, so we can skip straight to now
+            current_tick_ = now_tick;
+            break;
+         }
+         current_tick_ += 1;
+         for (int level = num_levels - 1; level > 0; --level) {
+            const auto shift = level * bits_per_level;
+            if ((current_tick_ & ((std::uint64_t{1} << shift) - 1)) == 0) {
+               cascade(wheel_[level][(current_tick_ >> shift) & (slots_per_level - 1)]);
+            }
+         }
+         auto& slot = wheel_[0][current_tick_ & (slots_per_level - 1)];
+         while (slot.next != &slot) {
+            auto& node = *slot.next;
+            unlink(node);
+            num_timers_ -= 1;
+            node.expired = true;
+            if (node.on_expire == nullptr || node.on_expire(node)) {
+               ready.push_back(node.task);
+            }
+         }
+      }
+   }
+
+private:
+   static constexpr int bits_per_level = 6;
+   static constexpr std::uint64_t slots_per_level = 1 << bits_per_level;
+   static constexpr int num_levels = 4;
+   static constexpr auto tick_length = std::chrono::milliseconds{1};
+
+   timer_wheel() noexcept
+   {
+      for (auto& level : wheel_) {
+         for (auto& slot : level) {
+            slot.prev = &slot;
+            slot.next = &slot;
+         }
+      }
+   }
+
+   // Ticks from the start to time, rounded up so timers never expire early
+   std::uint64_t ticks_until(clock::time_point time) const noexcept
+   { return static_cast<std::uint64_t>(std::chrono::ceil<std::chrono::milliseconds>(time - start_) / tick_length); }
+
+   // Whole ticks that have passed by time
+   std::uint64_t ticks_elapsed(clock::time_point time) const noexcept
+   { return static_cast<std::uint64_t>(std::chrono::floor<std::chrono::milliseconds>(time - start_) / tick_length); }
+
+   void insert(timer_node& node) noexcept
+   {
+      // Use the lowest level where the timer's slot will come around within one rotation
+      auto* slot = &wheel_[num_levels - 1][0];
+      int level = 0;
+      for (; level < num_levels; ++level) {
+         const auto shift = level * bits_per_level;
+         if ((node.expiry >> shift) - (current_tick_ >> shift) < slots_per_level) {
+            slot = &wheel_[level][(node.expiry >> shift) & (slots_per_level - 1)];
+            break;
+         }
+      }
+      if (level == num_levels) {
+         // Too far out, park it in the last slot to be reached and it'll be re-inserted from there
+         const auto shift = (num_levels - 1) * bits_per_level;
+         slot = &wheel_[num_levels - 1][((current_tick_ >> shift) - 1) & (slots_per_level - 1)];
+      }
+      node.prev = slot->prev;
+      node.next = slot;
+      slot->prev->next = &node;
+      slot->prev = &node;
+   }
+
+   void cascade(timer_node& slot) noexcept
+   {
+      timer_node list;
+      if (slot.next == &slot) {
+         return;
+      }
+      // Detach the whole list first as nodes can be re-inserted into the same slot
+      list.next = slot.next;
+      list.prev = slot.prev;
+      list.next->prev = &list;
+      list.prev->next = &list;
+      slot.next = &slot;
+      slot.prev = &slot;
+      while (list.next != &list) {
+         auto& node = *list.next;
+         unlink(node);
+         insert(node);
+      }
+   }
+
+   static void unlink(timer_node& node) noexcept
+   {
+      node.prev->next = node.next;
+      node.next->prev = node.prev;
+      node.prev = nullptr;
+      node.next = nullptr;
+   }
+
+   clock::time_point start_ = clock::now();
+   std::uint64_t current_tick_ = 0;
+   std::size_t num_timers_ = 0;
+   std::array<std::array<timer_node, slots_per_level>, num_levels> wheel_;
+};
+
+// For the timeouts of epoll_pwait2 and io_uring_enter
+template<typename Timespec = timespec>
+Timespec to_timespec(std::chrono::nanoseconds duration) noexcept
+{
+   Timespec ts;
+   ts.tv_sec = duration.count() / 1'000'000'000;
+   ts.tv_nsec = duration.count() % 1'000'000'000;
+   return ts;
+}
+
+// Resumes the task after at least duration has passed
+inline auto async_sleep(timer_wheel::clock::duration duration) noexcept
+{
+   struct sleep_awaiter {
+      bool await_ready() const noexcept { return duration <= timer_wheel::clock::duration::zero(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         // Not waiting on the socket, but keep the handle so it's still closed with the task
+         h.promise().sock_info_.events_to_test = 0;
+         timer.task = h;
+         timer_wheel::this_thread().arm(timer, duration);
+      }
+
+      void await_resume() const noexcept {}
+
+      timer_wheel::clock::duration duration;
+      timer_node timer;
+   };
+   return sleep_awaiter{duration, {}};
+}
+
+// Keeps a task whose socket always has data from starving the others on its thread. Awaiters that complete
+// without suspending (because the data was already there) each use up one operation of the budget the scheduler
+// gives every resume; once it's spent the next such awaiter suspends anyway and the task is put at the back of the
+// ready queue, after everything the scheduler found ready this turn. One per thread.
+class yield_budget {
+public:
+   static constexpr unsigned default_limit = 64;
+
+   static yield_budget& this_thread() noexcept
+   {
+      thread_local yield_budget budget;
+      return budget;
+   }
+
+   yield_budget(const yield_budget&) = delete;
+   yield_budget& operator=(const yield_budget&) = delete;
+
+   // Operations a resume may complete without suspending, 0 for no limit
+   void set_limit(unsigned limit) noexcept
+   {
+      limit_ = limit;
+      remaining_ = limit;
+   }
+
+   unsigned limit() const noexcept { return limit_; }
+
+   // Called by the scheduler before each resume
+   void reset() noexcept { remaining_ = limit_; }
+
+   // Called when an operation completes without suspending; false if the task should yield instead
+   bool consume() noexcept
+   {
+      if (limit_ == 0) {
+         return true;
+      }
+      if (remaining_ == 0) {
+         return false;
+      }
+      remaining_ -= 1;
+      return true;
+   }
+
+   // Queues a suspending task to be resumed on the next turn without waiting for anything
+   void defer(socket_task::handle_type h)
+   {
+      // Keep the handle so it's still closed with the task, but forget any on_ready of an earlier awaiter
+      auto& info = h.promise().sock_info_;
+      info = {0, info.handle};
+      deferred_.push_back(h);
+   }
+
+   bool has_deferred() const noexcept { return !deferred_.empty(); }
+
+   // Adds the deferred tasks to ready, after whatever is already there
+   void take_deferred(std::vector<socket_task::handle_type>& ready)
+   {
+      ready.insert(ready.end(), deferred_.begin(), deferred_.end());
+      deferred_.clear();
+   }
+
+private:
+   yield_budget() = default;
+
+   unsigned limit_ = default_limit;
+   unsigned remaining_ = default_limit;
+   std::vector<socket_task::handle_type> deferred_;
+};
+
+// Wraps every awaiter co_awaited by a socket_task or task<T> to charge it to the yield_budget
+template<typename Awaiter>
+struct budgeted_awaiter {
+   bool await_ready()
+   {
+      if (!inner.await_ready()) {
+         return false;
+      }
+      if (yield_budget::this_thread().consume()) {
+         return true;
+      }
+      // The result is ready, it's just collected after the other tasks have had a turn
+      yielded = true;
+      return false;
+   }
+
+   template<typename Promise>
+   auto await_suspend(std::coroutine_handle<Promise> h)
+   {
+      using result = decltype(inner.await_suspend(h));
+      if (yielded) {
+         if constexpr (std::is_same_v<Promise, socket_task::promise_type>) {
+            yield_budget::this_thread().defer(h);
+         }
+         else {
+            // The scheduler resumes the root, which carries on into this task<T>
+            yield_budget::this_thread().defer(h.promise().root_);
+         }
+         if constexpr (std::is_same_v<result, bool>) {
+            return true;
+         }
+         else if constexpr (!std::is_void_v<result>) {
+            return result{std::noop_coroutine()};
+         }
+      }
+      else {
+         return inner.await_suspend(h);
+      }
+   }
+
+   decltype(auto) await_resume() { return inner.await_resume(); }
+
+   Awaiter inner;
+   bool yielded = false;
+};
+
+// Lets the other ready tasks on the thread run before carrying on
+inline auto yield() noexcept
+{
+   struct yield_awaiter {
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) { yield_budget::this_thread().defer(h); }
+
+      void await_resume() const noexcept {}
+   };
+   return yield_awaiter{};
+}
+
+// Looks up host names on a couple of background threads so a slow lookup never stalls a scheduler, and keeps the
+// results for a while so connecting to the same host:port again doesn't look it up again. Concurrent lookups of
+// the same name share one getaddrinfo call. A lookup's result is handed back to the thread that started it
+// through that thread's eventfd, which its reactor waits on alongside the sockets (see take_completed). Only
+// IPv4 addresses are returned: AF_UNSPEC can put an IPv6 address first and the server is only IPv4.
+class resolver {
+public:
+   using clock = std::chrono::steady_clock;
+
+   struct address {
+      sockaddr_storage addr;
+      socklen_t len;
+   };
+
+   using addresses = std::vector<address>;
+
+   // Errors are getaddrinfo's EAI_ codes, which are negative so they can't be mistaken for errno values
+   using result = std::expected<std::shared_ptr<const addresses>, int>;
+
+   // A lookup that has been started, shared between the awaiter waiting on it and the resolver threads
+   struct request {
+      // Resumed once value is set. Cleared if the task is destroyed first; only used on the requesting thread.
+      socket_task::handle_type task;
+      result value;
+   };
+
+   static resolver& instance()
+   {
+      static resolver r;
+      return r;
+   }
+
+   resolver(const resolver&) = delete;
+   resolver& operator=(const resolver&) = delete;
+
+   ~resolver()
+   {
+      {
+         std::lock_guard lock{mutex_};
+         stopping_ = true;
+      }
+      work_ready_.notify_all();
+      for (auto& thread : threads_) {
+         thread.join();
+      }
+   }
+
+   // How long a lookup's result is reused for. Doesn't change when anything already cached expires.
+   void set_ttl(clock::duration ttl)
+   {
+      std::lock_guard lock{mutex_};
+      ttl_ = ttl;
+   }
+
+   // Names in an /etc/hosts style file ("address name [aliases...]" lines, # comments) resolve to the addresses
+   // given for them there instead of through getaddrinfo, so lookups can be tested without touching the system's
+   // configuration. Replaces any file loaded before and empties the cache. Returns false if it can't be read.
+   bool load_hosts_file(const char* path)
+   {
+      std::ifstream file{path};
+      if (!file) {
+         return false;
+      }
+      std::unordered_map<std::string, std::vector<in_addr>> hosts;
+      std::string line;
+      while (std::getline(file, line)) {
+         std::string_view rest{line};
+         rest = rest.substr(0, rest.find('#'));
+         const auto next_word = [&rest]() {
+            const auto start = std::min(rest.find_first_not_of(" \t\r"), rest.size());
+            const auto end = std::min(rest.find_first_of(" \t\r", start), rest.size());
+            const auto word = rest.substr(start, end - start);
+            rest.remove_prefix(end);
+            return word;
+         };
+         const std::string ip{next_word()};
+         in_addr ip_addr;
+         // IPv6 lines are skipped like getaddrinfo with AF_INET would
+         if (ip.empty() || inet_pton(AF_INET, ip.c_str(), &ip_addr) != 1) {
+            continue;
+         }
+         for (auto name = next_word(); !name.empty(); name = next_word()) {
+            hosts[std::string{name}].push_back(ip_addr);
+         }
+      }
+      std::lock_guard lock{mutex_};
+      hosts_ = std::move(hosts);
+      cache_.clear();
+      return true;
+   }
+
+   // The addresses for host:port if they're known without a lookup: the host is a numeric address, or it's been
+   // looked up within the TTL
+   std::optional<result> resolve_now(const char* host, const char* port)
+   {
+      in_addr ip_addr;
+      const auto port_number = parse_port(port);
+      if (port_number && inet_pton(AF_INET, host, &ip_addr) == 1) {
+         return to_addresses(std::span{&ip_addr, 1}, *port_number);
+      }
+      std::lock_guard lock{mutex_};
+      const auto found = cache_.find(cache_key(host, port));
+      if (found == cache_.end() || found->second.expires <= clock::now()) {
+         return std::nullopt;
+      }
+      return found->second.value;
+   }
+
+   // Starts looking up host:port for the calling thread, whose reactor resumes the request's task once it's done
+   std::shared_ptr<request> start(const char* host, const char* port)
+   {
+      auto req = std::make_shared<request>();
+      auto key = cache_key(host, port);
+      {
+         std::lock_guard lock{mutex_};
+         auto& waiting = in_flight_[key];
+         waiting.push_back({req, this_thread_mailbox()});
+         if (waiting.size() == 1) {
+            queue_.push_back({std::move(key), host, port});
+            if (threads_.empty()) {
+               for (int i = 0; i < num_threads; ++i) {
+                  threads_.emplace_back([this]() { work(); });
+               }
+            }
+         }
+      }
+      work_ready_.notify_one();
+      return req;
+   }
+
+   // The eventfd that becomes readable when lookups this thread started have finished
+   static int completion_fd() { return this_thread_mailbox()->fd; }
+
+   // Adds the tasks waiting on lookups this thread started that have finished to ready. Cheap when there are none,
+   // so reactors call it every turn.
+   static void take_completed(std::vector<socket_task::handle_type>& ready)
+   {
+      auto& box = *this_thread_mailbox();
+      if (!box.has_done.load(std::memory_order_acquire)) {
+         return;
+      }
+      // Reset the eventfd before taking the list, anything added after this wakes the reactor up again
+      std::uint64_t count;
+      [[maybe_unused]] const auto res = read(box.fd, &count, sizeof(count));
+      std::vector<std::shared_ptr<request>> done;
+      {
+         std::lock_guard lock{box.mutex};
+         done.swap(box.done);
+         box.has_done.store(false, std::memory_order_relaxed);
+      }
+      for (const auto& req : done) {
+         if (req->task) {
+            ready.push_back(req->task);
+         }
+      }
+   }
+
+private:
+   static constexpr int num_threads = 2;
+
+   // Finished lookups waiting for the thread that started them to pick them up
+   struct mailbox {
+      mailbox() noexcept : fd{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} { assert(fd != -1); }
+      ~mailbox() { close(fd); }
+
+      int fd;
+      std::mutex mutex;
+      std::vector<std::shared_ptr<request>> done;
+      std::atomic<bool> has_done{false};
+   };
+
+   struct waiter {
+      std::shared_ptr<request> req;
+      // Shared so a lookup can still be delivered after the thread that started it has exited
+      std::shared_ptr<mailbox> box;
+   };
+
+   struct job {
+      std::string key;
+      std::string host;
+      std::string port;
+   };
+
+   struct cache_entry {
+      std::shared_ptr<const addresses> value;
+      clock::time_point expires;
+   };
+
+   resolver() = default;
+
+   static const std::shared_ptr<mailbox>& this_thread_mailbox()
+   {
+      thread_local const auto box = std::make_shared<mailbox>();
+      return box;
+   }
+
+   static std::string cache_key(std::string_view host, std::string_view port)
+   {
+      std::string key{host};
+      key += ':';
+      key += port;
+      return key;
+   }
+
+   static std::optional<std::uint16_t> parse_port(std::string_view port) noexcept
+   {
+      std::uint16_t number;
+      const auto [end, ec] = std::from_chars(port.data(), port.data() + port.size(), number);
+      if (ec != std::errc{} || end != port.data() + port.size()) {
+         return std::nullopt;
+      }
+      return number;
+   }
+
+   static std::shared_ptr<const addresses> to_addresses(std::span<const in_addr> ip_addrs, std::uint16_t port)
+   {
+      auto result = std::make_shared<addresses>(ip_addrs.size());
+      for (std::size_t i = 0; i < ip_addrs.size(); ++i) {
+         auto& sin = reinterpret_cast<sockaddr_in&>((*result)[i].addr);
+         sin.sin_family = AF_INET;
+         sin.sin_port = htons(port);
+         sin.sin_addr = ip_addrs[i];
+         (*result)[i].len = sizeof(sockaddr_in);
+      }
+      return result;
+   }
+
+   // Runs on a resolver thread
+   result lookup(const job& j)
+   {
+      std::vector<in_addr> from_hosts_file;
+      {
+         std::lock_guard lock{mutex_};
+         const auto found = hosts_.find(j.host);
+         if (found != hosts_.end()) {
+            from_hosts_file = found->second;
+         }
+      }
+      if (!from_hosts_file.empty()) {
+         const auto port_number = parse_port(j.port);
+         if (!port_number) {
+            return std::unexpected(EAI_SERVICE);
+         }
+         return to_addresses(from_hosts_file, *port_number);
+      }
+
+      addrinfo hints;
+      std::memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_protocol = IPPROTO_IP;
+      addrinfo* info;
+      const auto res = getaddrinfo(j.host.c_str(), j.port.c_str(), &hints, &info);
+      if (res != 0) {
+         return std::unexpected(res);
+      }
+      auto found = std::make_shared<addresses>();
+      for (auto ptr = info; ptr; ptr = ptr->ai_next) {
+         auto& addr = found->emplace_back();
+         std::memcpy(&addr.addr, ptr->ai_addr, ptr->ai_addrlen);
+         addr.len = ptr->ai_addrlen;
+      }
+      freeaddrinfo(info);
+      return found;
+   }
+
+   void work()
+   {
+      std::unique_lock lock{mutex_};
+      while (true) {
+         work_ready_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+         if (stopping_) {
+            return;
+         }
+         const auto j = std::move(queue_.front());
+         queue_.pop_front();
+         lock.unlock();
+         const auto value = lookup(j);
+         lock.lock();
+
+         const auto now = clock::now();
+         if (value) {
+            if (cache_.size() >= max_cache_entries) {
+               std::erase_if(cache_, [now](const auto& entry) { return entry.second.expires <= now; });
+            }
+            cache_[j.key] = {*value, now + ttl_};
+         }
+         auto waiting = std::move(in_flight_[j.key]);
+         in_flight_.erase(j.key);
+         lock.unlock();
+         for (auto& [req, box] : waiting) {
+            req->value = value;
+            {
+               std::lock_guard box_lock{box->mutex};
+               box->done.push_back(std::move(req));
+               box->has_done.store(true, std::memory_order_release);
+            }
+            const std::uint64_t one = 1;
+            [[maybe_unused]] const auto res = write(box->fd, &one, sizeof(one));
+         }
+         lock.lock();
+      }
+   }
+
+   // Lookups that failed aren't cached, so this only fills up with names that resolved
+   static constexpr std::size_t max_cache_entries = 4096;
+
+   std::mutex mutex_;
+   std::condition_variable work_ready_;
+   std::deque<job> queue_;
+   // Requests waiting on each host:port being looked up, so each is only looked up once at a time
+   std::unordered_map<std::string, std::vector<waiter>> in_flight_;
+   std::unordered_map<std::string, cache_entry> cache_;
+   std::unordered_map<std::string, std::vector<in_addr>> hosts_;
+   clock::duration ttl_ = std::chrono::seconds{30};
+   bool stopping_ = false;
+   std::vector<std::thread> threads_;
+};
+
+// Resolves host and port (a number or a service name) with resolver, without blocking the scheduler. The strings
+// must stay valid until the co_await finishes.
+inline auto async_resolve(const char* host, const char* port) noexcept
+{
+   struct resolve_awaiter {
+      resolve_awaiter(const char* host, const char* port) noexcept : host{host}, port{port} {}
+      resolve_awaiter(resolve_awaiter&&) noexcept = default;
+
+      ~resolve_awaiter()
+      {
+         // Stop the reactor from resuming the task if it's destroyed while waiting
+         if (req) {
+            req->task = nullptr;
+         }
+      }
+
+      bool await_ready()
+      {
+         auto& r = resolver::instance();
+         if (auto now = r.resolve_now(host, port)) {
+            value = std::move(*now);
+            return true;
+         }
+         req = r.start(host, port);
+         return false;
+      }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         // Not waiting on the socket, but keep the handle so it's still closed with the task
+         h.promise().sock_info_.events_to_test = 0;
+         req->task = h;
+      }
+
+      resolver::result await_resume() noexcept { return req ? std::move(req->value) : std::move(value); }
+
+      const char* host;
+      const char* port;
+      std::shared_ptr<resolver::request> req;
+      resolver::result value;
+   };
+   return resolve_awaiter{host, port};
+}
+
+// Lets other threads hand work to a thread running socket_scheduler: new tasks, which are created on the
+// scheduler's thread, and tasks to resume, typically once another thread has finished something for them (see
+// async_offload). Posting is lock-free: items are pushed onto a singly linked list with a compare-and-swap and the
+// scheduler takes the whole list at once, so the only syscall is the eventfd write that wakes the scheduler, and
+// that's only made when the list was empty. The scheduler still returns once it has no tasks left, anything
+// posted after that is picked up by the next scheduler run on the thread. Not driven by work_stealing_scheduler.
+class injection_queue {
+public:
+   // A task waiting for another thread. Cleared if the task is destroyed first; only used on the queue's thread.
+   struct waiter {
+      socket_task::handle_type task;
+   };
+
+   // The calling thread's queue. Posters hold on to the shared_ptr, so posting to a thread that has exited is
+   // safe (the items are never run).
+   static const std::shared_ptr<injection_queue>& this_thread()
+   {
+      thread_local const auto queue = std::make_shared<injection_queue>();
+      return queue;
+   }
+
+   injection_queue() noexcept : fd_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} { assert(fd_ != -1); }
+
+   injection_queue(const injection_queue&) = delete;
+   injection_queue& operator=(const injection_queue&) = delete;
+
+   ~injection_queue()
+   {
+      delete_items(head_.exchange(nullptr, std::memory_order_acquire));
+      close(fd_);
+   }
+
+   // Any thread. make_task is called on the queue's thread and the task it returns is added to the scheduler's.
+   void post(std::move_only_function<socket_task()> make_task)
+   { push(new item{nullptr, std::move(make_task), nullptr}); }
+
+   // Any thread. Resumes the waiter's task unless it's been destroyed by the time the scheduler takes this.
+   void resume(std::shared_ptr<waiter> w) { push(new item{nullptr, nullptr, std::move(w)}); }
+
+   // Any thread. The task must stay suspended, and must not be destroyed, until the scheduler has resumed it.
+   void resume(socket_task::handle_type h) { resume(std::make_shared<waiter>(h)); }
+
+   // Readable when something has been posted since the last take
+   int fd() const noexcept { return fd_; }
+
+   // Queue's thread. Creates the tasks posted since the last call, adding them to tasks, and adds the tasks to
+   // resume to ready, both in the order they were posted. Cheap when nothing has been posted, so reactors call
+   // it every turn.
+   void take(std::vector<socket_task>& tasks, std::vector<socket_task::handle_type>& ready)
+   {
+      if (head_.load(std::memory_order_relaxed) == nullptr) {
+         return;
+      }
+      // Reset the eventfd before taking the list, anything pushed after this wakes the reactor up again
+      std::uint64_t count;
+      [[maybe_unused]] const auto res = read(fd_, &count, sizeof(count));
+      // The list is newest first
+      item* oldest = nullptr;
+      for (auto* it = head_.exchange(nullptr, std::memory_order_acquire); it;) {
+         auto* const next = it->next;
+         it->next = oldest;
+         oldest = it;
+         it = next;
+      }
+      for (auto* it = oldest; it; it = it->next) {
+         if (it->make_task) {
+            tasks.push_back(it->make_task());
+         }
+         else if (it->waiting->task) {
+            ready.push_back(it->waiting->task);
+         }
+      }
+      delete_items(oldest);
+   }
+
+private:
+   struct item {
+      item* next;
+      // One or the other is set
+      std::move_only_function<socket_task()> make_task;
+      std::shared_ptr<waiter> waiting;
+   };
+
+   void push(item* it)
+   {
+      auto* head = head_.load(std::memory_order_relaxed);
+      do {
+         it->next = head;
+      } while (!head_.compare_exchange_weak(head, it, std::memory_order_release, std::memory_order_relaxed));
+      if (head == nullptr) {
+         const std::uint64_t one = 1;
+         [[maybe_unused]] const auto res = write(fd_, &one, sizeof(one));
+      }
+   }
+
+   static void delete_items(item* it) noexcept
+   {
+      while (it) {
+         delete std::exchange(it, it->next);
+      }
+   }
+
+   std::atomic<item*> head_{nullptr};
+   int fd_;
+};
+
+// Runs work on another thread and resumes the awaiting task on its own thread with the result, so CPU heavy work
+// doesn't hold up the scheduler. submit is called with a job to run, and decides where: a thread pool's post, or
+// [](auto job) { std::thread{std::move(job)}.detach(); }. The job may be run on any thread, and must be run exactly
+// once. If the task is destroyed while the work is running, the work still finishes but its result is dropped.
+template<typename Submit, typename Work>
+   requires std::invocable<Work&>
+auto async_offload(Submit submit, Work work)
+{
+   using result_type = std::invoke_result_t<Work&>;
+
+   struct state : injection_queue::waiter {
+      // Unused when the work returns nothing
+      std::optional<std::conditional_t<std::is_void_v<result_type>, int, result_type>> value;
+   };
+
+   struct offload_awaiter {
+      offload_awaiter(Submit submit, Work work) : submit{std::move(submit)}, work{std::move(work)} {}
+      offload_awaiter(offload_awaiter&&) noexcept = default;
+
+      ~offload_awaiter()
+      {
+         // Stop the scheduler from resuming the task if it's destroyed while waiting
+         if (shared) {
+            shared->task = nullptr;
+         }
+      }
+
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h)
+      {
+         // Not waiting on the socket, but keep the handle so it's still closed with the task
+         h.promise().sock_info_.events_to_test = 0;
+         shared = std::make_shared<state>();
+         shared->task = h;
+         submit([shared = shared, work = std::move(work), queue = injection_queue::this_thread()]() mutable {
+            if constexpr (std::is_void_v<result_type>) {
+               work();
+            }
+            else {
+               shared->value.emplace(work());
+            }
+            queue->resume(std::move(shared));
+         });
+      }
+
+      result_type await_resume()
+      {
+         if constexpr (!std::is_void_v<result_type>) {
+            return std::move(*shared->value);
+         }
+      }
+
+      Submit submit;
+      Work work;
+      std::shared_ptr<state> shared;
+   };
+   return offload_awaiter{std::move(submit), std::move(work)};
+}
+
+// Drops the first num_bytes from iov, leaving the first entry pointing at the first unwritten byte
+inline void advance_iovecs(std::span<iovec>& iov, std::size_t num_bytes) noexcept
+{
+   while (!iov.empty() && num_bytes >= iov.front().iov_len) {
+      num_bytes -= iov.front().iov_len;
+      iov = iov.subspan(1);
+   }
+   if (num_bytes > 0) {
+      iov.front().iov_base = static_cast<char*>(iov.front().iov_base) + num_bytes;
+      iov.front().iov_len -= num_bytes;
+   }
+}
+
+// Sends everything written to an output_queue on this thread since the last call; defined with output_queue.
+// Returns true if some queue still has data the socket wouldn't take.
+inline bool flush_output_queues() noexcept;
+
+// What the scheduler running on a thread has been doing: how many tasks it has at each poll and how many it
+// wakes, how long resumed tasks run for and how long ready tasks wait to be resumed. Kept per thread and only
+// updated by that thread, for the cost of a clock read per resume; any thread can take a snapshot.
+class scheduler_stats {
+public:
+   using clock = std::chrono::steady_clock;
+
+   struct thread_snapshot {
+      // Order in which the threads first ran a scheduler
+      unsigned thread_index;
+      std::uint64_t polls;
+      // Polls after which nothing was resumed
+      std::uint64_t empty_polls;
+      std::uint64_t resumes;
+      // Tasks the scheduler had and tasks it resumed, per poll
+      histogram tasks_per_poll;
+      histogram ready_per_poll;
+      // Time each resume ran for, and from a task's socket being reported ready to it being resumed
+      histogram resume_ns;
+      histogram ready_wait_ns;
+      // The longest resume and the socket the task had been waiting on, to find the code path behind it
+      std::uint64_t slowest_resume_ns;
+      int slowest_resume_fd;
+      // With busy polling: zero timeout polls made while spinning, spins that found something before the budget
+      // ran out and the time spent spinning; and polls that blocked, busy polling or not
+      std::uint64_t busy_polls;
+      std::uint64_t busy_poll_hits;
+      std::uint64_t spin_ns;
+      std::uint64_t sleeps;
+   };
+
+   static scheduler_stats& this_thread() noexcept
+   {
+      thread_local scheduler_stats stats;
+      return stats;
+   }
+
+   // Every thread's stats that has run a scheduler and not exited
+   static std::vector<thread_snapshot> snapshot()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      std::vector<thread_snapshot> snapshots;
+      for (const auto* stats : reg.threads) {
+         auto& snap = snapshots.emplace_back();
+         snap.thread_index = stats->thread_index_;
+         snap.polls = stats->polls_;
+         snap.empty_polls = stats->empty_polls_;
+         snap.resumes = stats->resume_ns_.count();
+         snap.tasks_per_poll.merge(stats->tasks_per_poll_);
+         snap.ready_per_poll.merge(stats->ready_per_poll_);
+         snap.resume_ns.merge(stats->resume_ns_);
+         snap.ready_wait_ns.merge(stats->ready_wait_ns_);
+         snap.slowest_resume_ns = stats->slowest_resume_ns_;
+         snap.slowest_resume_fd = static_cast<int>(static_cast<std::uint64_t>(stats->slowest_resume_fd_));
+         snap.busy_polls = stats->busy_polls_;
+         snap.busy_poll_hits = stats->busy_poll_hits_;
+         snap.spin_ns = stats->spin_ns_;
+         snap.sleeps = stats->sleeps_;
+      }
+      return snapshots;
+   }
+
+   scheduler_stats(const scheduler_stats&) = delete;
+   scheduler_stats& operator=(const scheduler_stats&) = delete;
+
+   // Called when a poll returns, with the number of tasks the scheduler has; returns the time to pass to
+   // record_resume as when the tasks became ready
+   clock::time_point record_poll(std::size_t num_tasks) noexcept
+   {
+      polls_ += 1;
+      tasks_per_poll_.record(num_tasks);
+      return clock::now();
+   }
+
+   // Called once the tasks a poll made ready have been resumed
+   void record_ready(std::size_t num_ready) noexcept
+   {
+      ready_per_poll_.record(num_ready);
+      if (num_ready == 0) {
+         empty_polls_ += 1;
+      }
+   }
+
+   void record_resume(clock::time_point ready_since, clock::time_point start, clock::time_point end, int fd) noexcept
+   {
+      const auto ns = [](clock::duration d) {
+         return static_cast<std::uint64_t>(std::max<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), 0));
+      };
+      const auto ran_for = ns(end - start);
+      ready_wait_ns_.record(ns(start - ready_since));
+      resume_ns_.record(ran_for);
+      if (ran_for > slowest_resume_ns_) {
+         slowest_resume_ns_ = ran_for;
+         slowest_resume_fd_ = static_cast<std::uint64_t>(fd);
+      }
+   }
+
+   void record_spin(std::uint64_t num_polls, bool found, clock::duration spun) noexcept
+   {
+      busy_polls_ += num_polls;
+      if (found) {
+         busy_poll_hits_ += 1;
+      }
+      spin_ns_ += static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(spun).count());
+   }
+
+   // Called before a poll that may block
+   void record_sleep() noexcept { sleeps_ += 1; }
+
+private:
+   struct registry {
+      static registry& instance() noexcept
+      {
+         static registry reg;
+         return reg;
+      }
+
+      std::mutex mutex;
+      std::vector<scheduler_stats*> threads;
+      unsigned next_index = 0;
+   };
+
+   scheduler_stats()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      thread_index_ = reg.next_index++;
+      reg.threads.push_back(this);
+   }
+
+   ~scheduler_stats()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      std::erase(reg.threads, this);
+   }
+
+   unsigned thread_index_;
+   single_writer_counter polls_;
+   single_writer_counter empty_polls_;
+   shared_histogram tasks_per_poll_;
+   shared_histogram ready_per_poll_;
+   shared_histogram resume_ns_;
+   shared_histogram ready_wait_ns_;
+   single_writer_counter slowest_resume_ns_;
+   single_writer_counter slowest_resume_fd_;
+   single_writer_counter busy_polls_;
+   single_writer_counter busy_poll_hits_;
+   single_writer_counter spin_ns_;
+   single_writer_counter sleeps_;
+};
+
+// Opt-in busy polling for socket_scheduler: before blocking, the reactor polls with a zero timeout for up to this
+// long, trading a core for not paying for a wakeup when something arrives soon after it ran out of work. Set per
+// thread before running the scheduler; 0 (the default) never spins.
+class busy_poll_budget {
+public:
+   static std::chrono::nanoseconds& this_thread() noexcept
+   {
+      thread_local std::chrono::nanoseconds budget{};
+      return budget;
+   }
+};
+
+// Bookkeeping shared by the reactors: tracks which tasks in the vector have been seen and removes finished ones
+// by swapping them with the last task, using the index kept in the promise. Reactor must provide
+// on_task_suspended(h), called whenever an adopted task suspends, and on_task_retired(h), called just before a
+// finished task is destroyed.
+template<typename Reactor>
+class reactor_base {
+public:
+   reactor_base(const reactor_base&) = delete;
+   reactor_base& operator=(const reactor_base&) = delete;
+
+protected:
+   explicit reactor_base(std::vector<socket_task>& tasks) noexcept : tasks_{tasks} {}
+
+   // Spins on poll_now, which polls without blocking and returns whether it found anything, for up to the thread's
+   // busy_poll_budget or until the timeout (which is shortened by the time spent) has passed. Returns true if
+   // something was found, otherwise the reactor should go on to block.
+   template<typename PollNow>
+   static bool busy_poll(std::optional<std::chrono::nanoseconds>& timeout, PollNow&& poll_now)
+   {
+      const auto budget = busy_poll_budget::this_thread();
+      if (budget <= std::chrono::nanoseconds{} || (timeout && *timeout <= std::chrono::nanoseconds{})) {
+         return false;
+      }
+      const auto limit = timeout ? std::min(budget, *timeout) : budget;
+      const auto start = scheduler_stats::clock::now();
+      auto spun = scheduler_stats::clock::duration{};
+      std::uint64_t num_polls = 0;
+      bool found = false;
+      while (!found && spun < limit) {
+         num_polls += 1;
+         found = poll_now();
+         spun = scheduler_stats::clock::now() - start;
+      }
+      scheduler_stats::this_thread().record_spin(num_polls, found, spun);
+      if (timeout) {
+         *timeout = std::max(std::chrono::nanoseconds{}, *timeout - spun);
+      }
+      return found;
+   }
+
+   // Resumes the tasks a poll made ready at ready_since, recording them in the thread's scheduler_stats
+   void resume_ready(const std::vector<socket_task::handle_type>& ready, scheduler_stats::clock::time_point ready_since)
+   {
+      auto& stats = scheduler_stats::this_thread();
+      auto& budget = yield_budget::this_thread();
+      // Bookkeeping between resumes counts as waiting for the next task, so there's one clock read per resume
+      auto start = scheduler_stats::clock::now();
+      for (const auto h : ready) {
+         const auto fd = h.promise().sock_info_.handle;
+         budget.reset();
+         h.promise().leaf_.resume();
+         const auto end = scheduler_stats::clock::now();
+         stats.record_resume(ready_since, start, end, fd);
+         after_resume(h);
+         start = end;
+      }
+      stats.record_ready(ready.size());
+   }
+
+   // Bookkeeping to be done each time a task the reactor resumed returns control to it
+   void after_resume(socket_task::handle_type h) noexcept
+   {
+      adopt_new_tasks();
+      if (h.done()) {
+         retire(h.promise().task_index_);
+      }
+      else {
+         reactor().on_task_suspended(h);
+      }
+   }
+
+   // Adds the tasks posted to the thread's injection_queue to the scheduler's, and the tasks to resume to ready
+   void take_injected(injection_queue& queue, std::vector<socket_task::handle_type>& ready)
+   {
+      queue.take(tasks_, ready);
+      adopt_new_tasks();
+   }
+
+   // Picks up tasks pushed onto the vector since the last call (e.g. by server_accept_loop)
+   void adopt_new_tasks() noexcept
+   {
+      const auto first_new = known_tasks_;
+      known_tasks_ = tasks_.size();
+      for (auto index = first_new; index < known_tasks_; ++index) {
+         const auto h = tasks_[index].handle();
+         h.promise().task_index_ = index;
+         if (!h.done()) {
+            reactor().on_task_suspended(h);
+         }
+      }
+      // Go backwards so that retiring one task never moves another finished one we have yet to visit
+      for (auto index = known_tasks_; index > first_new; --index) {
+         if (tasks_[index - 1].done()) {
+            retire(index - 1);
+         }
+      }
+   }
+
+   // Destroys a finished task; only tasks that have been adopted may be retired
+   void retire(std::size_t index) noexcept
+   {
+      assert(index < known_tasks_ && known_tasks_ == tasks_.size());
+      reactor().on_task_retired(tasks_[index].handle());
+      socket_task finished = std::move(tasks_[index]);
+      if (index != tasks_.size() - 1) {
+         tasks_[index] = std::move(tasks_.back());
+         tasks_[index].handle().promise().task_index_ = index;
+      }
+      tasks_.pop_back();
+      known_tasks_ -= 1;
+   }
+
+   std::vector<socket_task>& tasks_;
+
+private:
+   Reactor& reactor() noexcept { return static_cast<Reactor&>(*this); }
+
+   std::size_t known_tasks_ = 0;
+};
+
+#ifdef COROUTINES1_IO_URING
+
+// The io_uring instance for the current thread. Tasks start running as soon as they're created, before any
+// scheduler is running, so the ring has to exist independently of the reactor that drains it.
+class io_uring_ring {
+public:
+   // What an SQE's user_data points at; filled in with the CQE's result before the task is resumed
+   struct completion {
+      socket_task::handle_type task;
+      int result = 0;
+      // If set, called once the result is stored and the task is only resumed if it returns true, which lets an
+      // awaiter queue follow up operations without a trip through the task
+      bool (*on_complete)(completion&) noexcept = nullptr;
+      void* context = nullptr;
+   };
+
+   static io_uring_ring& this_thread() noexcept
+   {
+      thread_local io_uring_ring ring{4096};
+      return ring;
+   }
+
+   io_uring_ring(const io_uring_ring&) = delete;
+   io_uring_ring& operator=(const io_uring_ring&) = delete;
+
+   ~io_uring_ring()
+   {
+      munmap(sqes_, sqes_size_);
+      munmap(ring_, ring_size_);
+      close(ring_fd_);
+   }
+
+   // Returns a zeroed SQE that will be handed to the kernel on the next call to enter
+   io_uring_sqe& queue(completion& comp) noexcept
+   {
+      auto& sqe = queue_untracked();
+      sqe.user_data = reinterpret_cast<std::uint64_t>(&comp);
+      return sqe;
+   }
+
+   // Same as queue, but nothing is resumed when the operation completes
+   io_uring_sqe& queue_untracked() noexcept
+   {
+      if (local_tail_ - std::atomic_ref{*sq_head_}.load(std::memory_order_acquire) == sq_entries_) {
+         // The submission queue is full, hand what we have to the kernel without waiting
+         enter(0);
+         // Only if the completion queue has overflowed too, which reaping would fix but that can't be done here
+         if (local_tail_ - std::atomic_ref{*sq_head_}.load(std::memory_order_acquire) == sq_entries_) {
+            std::fputs("io_uring submission and completion queues are both full\n", stderr);
+            std::abort();
+         }
+      }
+      const auto index = local_tail_ & sq_mask_;
+      sq_array_[index] = index;
+      local_tail_ += 1;
+      auto& sqe = sqes_[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      return sqe;
+   }
+
+   // Submits everything queued that the kernel hasn't taken yet and waits for at least min_complete completions,
+   // or until the timeout has passed if there is one. Returns straight away if the completion queue has
+   // overflowed, as the kernel won't take more until the caller reaps; the rest are submitted by the next call.
+   void enter(unsigned min_complete, std::optional<std::chrono::nanoseconds> wait = std::nullopt) noexcept
+   {
+      std::atomic_ref{*sq_tail_}.store(local_tail_, std::memory_order_release);
+      auto timeout = to_timespec<__kernel_timespec>(wait.value_or(std::chrono::nanoseconds{}));
+      io_uring_getevents_arg arg;
+      std::memset(&arg, 0, sizeof(arg));
+      arg.ts = reinterpret_cast<std::uint64_t>(&timeout);
+      const bool has_timeout = wait.has_value();
+      const auto flags = IORING_ENTER_GETEVENTS | (has_timeout ? IORING_ENTER_EXT_ARG : 0);
+      while (true) {
+         const auto to_submit = local_tail_ - std::atomic_ref{*sq_head_}.load(std::memory_order_acquire);
+         const auto res = syscall(
+            __NR_io_uring_enter,
+            ring_fd_,
+            to_submit,
+            min_complete,
+            flags,
+            has_timeout ? static_cast<void*>(&arg) : nullptr,
+            has_timeout ? sizeof(arg) : 0);
+         if (res >= 0) {
+            break;
+         }
+         // Hitting the timeout is reported as ETIME, and an overflowed completion queue as EBUSY
+         if (errno == ETIME || errno == EBUSY) {
+            break;
+         }
+         // Nothing else should fail with a correctly set up ring, and retrying wouldn't help if it did
+         if (errno != EINTR) {
+            std::fprintf(stderr, "io_uring_enter failed: %s\n", std::strerror(errno));
+            std::abort();
+         }
+      }
+   }
+
+   // Whether there are CQEs that reap hasn't taken yet
+   bool has_completions() const noexcept
+   { return *cq_head_ != std::atomic_ref{*cq_tail_}.load(std::memory_order_acquire); }
+
+   // Stores the result of every available CQE in its completion and calls func with the ones whose task should be
+   // resumed
+   template<typename Func>
+   void reap(Func&& func) noexcept
+   {
+      auto head = *cq_head_;
+      const auto tail = std::atomic_ref{*cq_tail_}.load(std::memory_order_acquire);
+      for (; head != tail; ++head) {
+         const auto& cqe = cqes_[head & cq_mask_];
+         // Completions of cancellations, which nothing waits on
+         if (cqe.user_data == 0) {
+            continue;
+         }
+         auto& comp = *reinterpret_cast<completion*>(cqe.user_data);
+         comp.result = cqe.res;
+         if (comp.on_complete == nullptr || comp.on_complete(comp)) {
+            func(comp);
+         }
+      }
+      std::atomic_ref{*cq_head_}.store(head, std::memory_order_release);
+   }
+
+private:
+   explicit io_uring_ring(unsigned entries) noexcept
+   {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      assert(ring_fd_ >= 0);
+      // Every kernel with the operations used here (5.6+) has IORING_FEAT_SINGLE_MMAP
+      assert(params.features & IORING_FEAT_SINGLE_MMAP);
+
+      ring_size_ = std::max(
+         params.sq_off.array + params.sq_entries * sizeof(std::uint32_t),
+         params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+      ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+      assert(ring_ != MAP_FAILED);
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+      sqes_ = static_cast<io_uring_sqe*>(
+         mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+      assert(sqes_ != MAP_FAILED);
+
+      auto* const base = static_cast<char*>(ring_);
+      sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+      sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+      sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+      sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+      sq_entries_ = params.sq_entries;
+      cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+      cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+   }
+
+   int ring_fd_;
+   void* ring_;
+   std::size_t ring_size_;
+   io_uring_sqe* sqes_;
+   std::size_t sqes_size_;
+   unsigned* sq_head_;
+   unsigned* sq_tail_;
+   unsigned* sq_array_;
+   unsigned sq_mask_;
+   unsigned sq_entries_;
+   unsigned local_tail_ = 0;
+   unsigned* cq_head_;
+   unsigned* cq_tail_;
+   unsigned cq_mask_;
+   io_uring_cqe* cqes_;
+};
+
+// A read of an eventfd that wakes the ring up when the eventfd is written; it completes without resuming anything
+struct io_uring_wakeup {
+   // Queues the read unless it's still pending
+   void arm(io_uring_ring& ring, int fd) noexcept
+   {
+      if (armed) {
+         return;
+      }
+      comp.on_complete = [](io_uring_ring::completion& c) noexcept {
+         *static_cast<bool*>(c.context) = false;
+         return false;
+      };
+      comp.context = &armed;
+      auto& sqe = ring.queue(comp);
+      sqe.opcode = IORING_OP_READ;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<std::uint64_t>(&count);
+      sqe.len = sizeof(count);
+      armed = true;
+   }
+
+   io_uring_ring::completion comp;
+   std::uint64_t count = 0;
+   bool armed = false;
+};
+
+// Completion-based backend: instead of waiting for readiness and then doing the operation, the awaiters queue
+// the operation itself as an SQE and the task is resumed with its result once the CQE arrives. SQEs queued
+// while running tasks are only handed to the kernel at the start of the next turn, so one io_uring_enter both
+// submits the whole batch and waits for completions.
+class io_uring_reactor : public reactor_base<io_uring_reactor> {
+public:
+   explicit io_uring_reactor(std::vector<socket_task>& tasks) noexcept
+      : reactor_base{tasks}, ring_{io_uring_ring::this_thread()}
+   {}
+
+   void run() noexcept
+   {
+      adopt_new_tasks();
+      std::vector<socket_task::handle_type> ready;
+      auto& timers = timer_wheel::this_thread();
+      auto& stats = scheduler_stats::this_thread();
+      auto& budget = yield_budget::this_thread();
+      while (!tasks_.empty()) {
+         // Nothing tells us when a socket that wouldn't take all its output becomes writable again, so poll
+         // for it every millisecond until it does
+         const auto output_left = flush_output_queues();
+         std::optional<std::chrono::nanoseconds> timeout = timers.next_timeout();
+         if (output_left && (!timeout || *timeout > std::chrono::milliseconds{1})) {
+            timeout = std::chrono::milliseconds{1};
+         }
+         // Tasks that yielded are ready already, so only pick up what else is ready
+         const bool any_deferred = budget.has_deferred();
+         if (any_deferred) {
+            timeout = std::chrono::nanoseconds{};
+         }
+         resolver_wakeup_.arm(ring_, resolver::completion_fd());
+         injection_wakeup_.arm(ring_, injected_->fd());
+         const auto spin_found = busy_poll(timeout, [this]() {
+            ring_.enter(0);
+            return ring_.has_completions();
+         });
+         if (!spin_found) {
+            if (timeout != std::chrono::nanoseconds{}) {
+               stats.record_sleep();
+            }
+            ring_.enter(any_deferred ? 0 : 1, timeout);
+         }
+         const auto ready_since = stats.record_poll(tasks_.size());
+         ready.clear();
+         timers.expire(ready);
+         ring_.reap([&](const io_uring_ring::completion& comp) { ready.push_back(comp.task); });
+         resolver::take_completed(ready);
+         take_injected(*injected_, ready);
+         budget.take_deferred(ready);
+         resume_ready(ready, ready_since);
+      }
+   }
+
+private:
+   friend reactor_base;
+
+   // Nothing to do, the awaiter queued its operation while suspending
+   void on_task_suspended(socket_task::handle_type) noexcept {}
+
+   void on_task_retired(socket_task::handle_type) noexcept {}
+
+   io_uring_ring& ring_;
+   const std::shared_ptr<injection_queue> injected_ = injection_queue::this_thread();
+   // The reads of the resolver's and the injection_queue's eventfds outlive the reactor if nothing wakes them
+   // while it runs, so they're kept per thread like the ring
+   static inline thread_local io_uring_wakeup resolver_wakeup_;
+   static inline thread_local io_uring_wakeup injection_wakeup_;
+};
+
+// Result conversion shared by the io_uring awaiters
+inline std::expected<int, int> uring_result(int res) noexcept
+{
+   if (res < 0) {
+      return std::unexpected(-res);
+   }
+   return res;
+}
+
+// Connects to the first of addresses a socket can be created for, see the async_connect taking a host name
+inline auto async_connect(std::span<const resolver::address> addresses) noexcept
+{
+   struct connect_awaiter {
+      bool await_ready() noexcept
+      {
+         // Unlike the readiness version this can't fall back to the next address after a failed connect without
+         // another round trip, so only the first address a socket can be created for is tried
+         for (const auto& address : addresses) {
+            sock_handle = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_IP);
+            if (sock_handle == -1) {
+               err = errno;
+               continue;
+            }
+            err = 0;
+            sock_addr = &address;
+            return false;
+         }
+         return true;
+      }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_CONNECT;
+         sqe.fd = sock_handle;
+         sqe.addr = reinterpret_cast<std::uint64_t>(&sock_addr->addr);
+         sqe.off = sock_addr->len;
+      }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         if (comp.result < 0) {
+            return std::unexpected(-comp.result);
+         }
+         return sock_handle;
+      }
+
+      int sock_handle;
+      int err;
+      io_uring_ring::completion comp;
+      std::span<const resolver::address> addresses;
+      const resolver::address* sock_addr;
+   };
+   return connect_awaiter{-1, ENOENT, {}, addresses, nullptr};
+}
+
+auto async_read(int sock_handle, char* buffer, std::size_t buf_size) noexcept
+{
+   struct read_awaiter {
+      bool await_ready() noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_RECV;
+         sqe.fd = sock_handle;
+         sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+         sqe.len = static_cast<std::uint32_t>(buf_size);
+      }
+
+      std::expected<int, int> await_resume() noexcept { return uring_result(comp.result); }
+
+      int sock_handle;
+      io_uring_ring::completion comp;
+      std::size_t buf_size;
+      char* buffer;
+   };
+
+   return read_awaiter{sock_handle, {}, buf_size, buffer};
+}
+
+auto async_write(int sock_handle, const char* buffer, std::size_t buf_size) noexcept
+{
+   struct write_awaiter {
+      bool await_ready() noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_SEND;
+         sqe.fd = sock_handle;
+         sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+         sqe.len = static_cast<std::uint32_t>(buf_size);
+      }
+
+      std::expected<int, int> await_resume() noexcept { return uring_result(comp.result); }
+
+      int sock_handle;
+      io_uring_ring::completion comp;
+      std::size_t buf_size;
+      const char* buffer;
+   };
+
+   return write_awaiter{sock_handle, {}, buf_size, buffer};
+}
+
+// Writes all of iov, modifying it as the data is written; only fails if the socket does
+inline auto async_writev(int sock_handle, std::span<iovec> iov) noexcept
+{
+   struct writev_awaiter {
+      bool await_ready() noexcept { return iov.empty(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         comp.on_complete = &on_complete;
+         comp.context = this;
+         queue_writev();
+      }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return total_written;
+      }
+
+      void queue_writev() noexcept
+      {
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_WRITEV;
+         sqe.fd = sock_handle;
+         sqe.addr = reinterpret_cast<std::uint64_t>(iov.data());
+         sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(iov.size(), IOV_MAX));
+      }
+
+      // Keeps going after partial writes without resuming the task
+      static bool on_complete(io_uring_ring::completion& c) noexcept
+      {
+         auto& self = *static_cast<writev_awaiter*>(c.context);
+         if (c.result < 0) {
+            self.err = -c.result;
+            return true;
+         }
+         self.total_written += c.result;
+         advance_iovecs(self.iov, c.result);
+         if (self.iov.empty()) {
+            return true;
+         }
+         self.queue_writev();
+         return false;
+      }
+
+      int sock_handle;
+      int err;
+      int total_written;
+      std::span<iovec> iov;
+      io_uring_ring::completion comp;
+   };
+
+   return writev_awaiter{sock_handle, 0, 0, iov, {}};
+}
+
+auto async_accept(int sock_handle) noexcept
+{
+   struct accept_awaiter {
+      bool await_ready() noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_ACCEPT;
+         sqe.fd = sock_handle;
+         sqe.accept_flags = SOCK_NONBLOCK;
+      }
+
+      std::expected<int, int> await_resume() noexcept { return uring_result(comp.result); }
+
+      int sock_handle;
+      io_uring_ring::completion comp;
+   };
+
+   return accept_awaiter{sock_handle, {}};
+}
+
+// Accepts as many connections as are waiting, up to accepted.size(), once there is at least one, filling accepted
+// with their non-blocking sockets and returning how many there are. The first is accepted by the ring and the rest
+// with accept4, which needs the listening socket to be non-blocking.
+inline auto async_accept(int sock_handle, std::span<int> accepted) noexcept
+{
+   struct accept_batch_awaiter {
+      bool await_ready() noexcept { return accepted.empty(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_ACCEPT;
+         sqe.fd = sock_handle;
+         sqe.accept_flags = SOCK_NONBLOCK;
+      }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (accepted.empty()) {
+            return 0;
+         }
+         if (comp.result < 0) {
+            return std::unexpected(-comp.result);
+         }
+         accepted[0] = comp.result;
+         std::size_t num_accepted = 1;
+         while (num_accepted < accepted.size()) {
+            const auto new_socket_handle = accept4(sock_handle, nullptr, nullptr, SOCK_NONBLOCK);
+            if (new_socket_handle < 0) {
+               // Whatever went wrong will happen again on the next call if it wasn't just an empty queue
+               break;
+            }
+            accepted[num_accepted] = new_socket_handle;
+            num_accepted += 1;
+         }
+         return num_accepted;
+      }
+
+      int sock_handle;
+      std::span<int> accepted;
+      io_uring_ring::completion comp;
+   };
+
+   return accept_batch_awaiter{sock_handle, accepted, {}};
+}
+
+// Receives up to msgs.size() datagrams with recvmmsg once there's at least one, returning how many; each header's
+// msg_len is set to the size of its datagram (datagram_batch sets the headers up). The ring has no batched
+// receive, so this tries straight away, which at high packet rates usually finds something, and otherwise polls
+// the socket through the ring and receives once it's readable.
+inline auto async_recv_batch(int sock_handle, std::span<mmsghdr> msgs) noexcept
+{
+   struct recv_batch_awaiter {
+      bool await_ready() noexcept { return msgs.empty() || try_recv(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         comp.on_complete = &on_complete;
+         comp.context = this;
+         queue_poll();
+      }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return num_received;
+      }
+
+      // Returns false if there's nothing to receive yet
+      bool try_recv() noexcept
+      {
+         const auto res = recvmmsg(sock_handle, msgs.data(), static_cast<unsigned>(msgs.size()), MSG_DONTWAIT, nullptr);
+         if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               return false;
+            }
+            err = errno;
+            return true;
+         }
+         num_received = static_cast<std::size_t>(res);
+         return true;
+      }
+
+      void queue_poll() noexcept
+      {
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_POLL_ADD;
+         sqe.fd = sock_handle;
+         sqe.poll32_events = POLLIN;
+      }
+
+      // Receives as soon as the poll completes, polling again if another receiver got there first
+      static bool on_complete(io_uring_ring::completion& c) noexcept
+      {
+         auto& self = *static_cast<recv_batch_awaiter*>(c.context);
+         if (c.result < 0) {
+            self.err = -c.result;
+            return true;
+         }
+         if (self.try_recv()) {
+            return true;
+         }
+         self.queue_poll();
+         return false;
+      }
+
+      int sock_handle;
+      int err;
+      std::size_t num_received;
+      std::span<mmsghdr> msgs;
+      io_uring_ring::completion comp;
+   };
+
+   return recv_batch_awaiter{sock_handle, 0, 0, msgs, {}};
+}
+
+// Sends every datagram in msgs with sendmmsg, waiting for room in the socket's buffer as needed, and returns how
+// many were sent. That's only fewer than msgs.size() if one failed after others were sent; the error is reported
+// if the first one fails. Like async_recv_batch it polls through the ring when the socket is full.
+inline auto async_send_batch(int sock_handle, std::span<mmsghdr> msgs) noexcept
+{
+   struct send_batch_awaiter {
+      bool await_ready() noexcept { return try_send(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         h.promise().sock_info_ = {0, sock_handle};
+         comp.task = h;
+         comp.on_complete = &on_complete;
+         comp.context = this;
+         queue_poll();
+      }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return num_sent;
+      }
+
+      // Returns false if the socket's buffer fills up before everything is sent
+      bool try_send() noexcept
+      {
+         while (num_sent < msgs.size()) {
+            const auto remaining = msgs.subspan(num_sent);
+            const auto res
+               = sendmmsg(sock_handle, remaining.data(), static_cast<unsigned>(remaining.size()), MSG_DONTWAIT);
+            if (res < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                  return false;
+               }
+               if (num_sent == 0) {
+                  err = errno;
+               }
+               return true;
+            }
+            num_sent += static_cast<std::size_t>(res);
+         }
+         return true;
+      }
+
+      void queue_poll() noexcept
+      {
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_POLL_ADD;
+         sqe.fd = sock_handle;
+         sqe.poll32_events = POLLOUT;
+      }
+
+      static bool on_complete(io_uring_ring::completion& c) noexcept
+      {
+         auto& self = *static_cast<send_batch_awaiter*>(c.context);
+         if (c.result < 0) {
+            self.err = -c.result;
+            return true;
+         }
+         if (self.try_send()) {
+            return true;
+         }
+         self.queue_poll();
+         return false;
+      }
+
+      int sock_handle;
+      int err;
+      std::size_t num_sent;
+      std::span<mmsghdr> msgs;
+      io_uring_ring::completion comp;
+   };
+
+   return send_batch_awaiter{sock_handle, 0, 0, msgs, {}};
+}
+
+// Fails with ETIMEDOUT if awaiter's operation hasn't completed within timeout. Works with any awaiter whose
+// await_resume returns a std::expected with an errno value as the error and that keeps its pending operation's
+// completion in a member named comp. On expiry the operation is cancelled and the task is resumed once the
+// cancellation completes; if the operation won the race its result is returned as normal.
+template<typename Awaiter>
+auto with_timeout(Awaiter awaiter, timer_wheel::clock::duration timeout) noexcept
+{
+   struct timeout_awaiter : timer_node {
+      bool await_ready() noexcept { return inner.await_ready(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         inner.await_suspend(h);
+         task = h;
+         on_expire = &cancel_inner;
+         timer_wheel::this_thread().arm(*this, timeout);
+      }
+
+      auto await_resume() noexcept -> decltype(std::declval<Awaiter&>().await_resume())
+      {
+         timer_wheel::this_thread().cancel(*this);
+         const auto result = inner.await_resume();
+         if (expired && !result && result.error() == ECANCELED) {
+            return std::unexpected(ETIMEDOUT);
+         }
+         return result;
+      }
+
+      static bool cancel_inner(timer_node& node) noexcept
+      {
+         auto& self = static_cast<timeout_awaiter&>(node);
+         auto& sqe = io_uring_ring::this_thread().queue_untracked();
+         sqe.opcode = IORING_OP_ASYNC_CANCEL;
+         sqe.addr = reinterpret_cast<std::uint64_t>(&self.inner.comp);
+         return false;
+      }
+
+      Awaiter inner;
+      timer_wheel::clock::duration timeout;
+   };
+   return timeout_awaiter{{}, std::move(awaiter), timeout};
+}
+
+inline void socket_scheduler(std::vector<socket_task>& tasks) noexcept { io_uring_reactor{tasks}.run(); }
+
+#else
+
+// Connects to the first of addresses that accepts a connection, see the async_connect taking a host name
+inline auto async_connect(std::span<const resolver::address> addresses) noexcept
+{
+   struct connect_awaiter {
+      bool await_ready() noexcept
+      {
+         // Only addresses that fail straight away are skipped, waiting on each in turn would take another
+         // layer of coroutines
+         for (const auto& address : addresses) {
+            sock_handle = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_IP);
+            if (sock_handle == -1) {
+               err = errno;
+               continue;
+            }
+            const auto res = connect(sock_handle, reinterpret_cast<const sockaddr*>(&address.addr), address.len);
+            if (res == -1) {
+               if (errno != EINPROGRESS) {
+                  // Some unexpected error occurred, try the next address
+                  err = errno;
+                  close(sock_handle);
+                  sock_handle = -1;
+                  continue;
+               }
+               // We're waiting on the connection, can't resume yet
+               err = 0;
+               return false;
+            }
+            // We connected without error, so we can resume right away
+            err = 0;
+            return true;
+         }
+         // if we reach here it means it errored so we can resume right away
+         return true;
+      }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLOUT, sock_handle}; }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (err == 0) {
+            socklen_t errsize = sizeof(err);
+            getsockopt(sock_handle, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &errsize);
+         }
+         if (err == 0) {
+            return sock_handle;
+         }
+         return std::unexpected(err);
+      }
+
+      int sock_handle;
+      int err;
+      std::span<const resolver::address> addresses;
+   };
+   return connect_awaiter{-1, ENOENT, addresses};
+}
+
+auto async_read(int sock_handle, char* buffer, std::size_t buf_size) noexcept
+{
+   struct read_awaiter {
+      bool await_ready() noexcept { return try_read(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLIN, sock_handle}; }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (!read_done) {
+            const bool result = try_read();
+            assert(result);
+            (void)result;
+         }
+         if (err == 0) {
+            return num_bytes_read;
+         }
+         return std::unexpected(err);
+      }
+
+      bool try_read() noexcept
+      {
+         num_bytes_read = read(sock_handle, buffer, buf_size);
+         if (num_bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            err = errno;
+            read_done = true;
+            return true;
+         }
+         read_done = num_bytes_read >= 0;
+         return read_done;
+      }
+
+      bool read_done;
+      int sock_handle;
+      int err;
+      int num_bytes_read;
+      std::size_t buf_size;
+      char* buffer;
+   };
+
+   return read_awaiter{false, sock_handle, 0, 0, buf_size, buffer};
+}
+
+auto async_write(int sock_handle, const char* buffer, std::size_t buf_size) noexcept
+{
+   struct write_awaiter {
+      bool await_ready() noexcept { return try_write(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLOUT, sock_handle}; }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (!write_done) {
+            const auto result = try_write();
+            assert(result);
+            (void)result;
+         }
+         if (err == 0) {
+            return num_bytes_written;
+         }
+         return std::unexpected(err);
+      }
+
+      bool try_write() noexcept
+      {
+         num_bytes_written = write(sock_handle, buffer, buf_size);
+         if (num_bytes_written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            err = errno;
+            write_done = true;
+            return true;
+         }
+         write_done = num_bytes_written >= 0;
+         return write_done;
+      }
+
+      bool write_done;
+      int sock_handle;
+      int err;
+      int num_bytes_written;
+      std::size_t buf_size;
+      const char* buffer;
+   };
+
+   return write_awaiter{false, sock_handle, 0, 0, buf_size, buffer};
+}
+
+// Writes all of iov, modifying it as the data is written; only fails if the socket does
+inline auto async_writev(int sock_handle, std::span<iovec> iov) noexcept
+{
+   struct writev_awaiter {
+      bool await_ready() noexcept { return try_write(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLOUT, sock_handle, &on_ready, this}; }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return total_written;
+      }
+
+      // Returns false if the socket would block before everything is written
+      bool try_write() noexcept
+      {
+         while (!iov.empty()) {
+            const auto num_written
+               = writev(sock_handle, iov.data(), static_cast<int>(std::min<std::size_t>(iov.size(), IOV_MAX)));
+            if (num_written < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                  return false;
+               }
+               err = errno;
+               return true;
+            }
+            total_written += num_written;
+            advance_iovecs(iov, num_written);
+         }
+         return true;
+      }
+
+      // Keeps going after partial writes without resuming the task
+      static bool on_ready(void* self) noexcept { return static_cast<writev_awaiter*>(self)->try_write(); }
+
+      int sock_handle;
+      int err;
+      int total_written;
+      std::span<iovec> iov;
+   };
+
+   return writev_awaiter{sock_handle, 0, 0, iov};
+}
+
+auto async_accept(int sock_handle) noexcept
+{
+   struct accept_awaiter {
+      bool await_ready() noexcept { return try_accept(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLIN, sock_handle}; }
+
+      std::expected<int, int> await_resume() noexcept
+      {
+         if (!accept_done) {
+            const auto result = try_accept();
+            assert(result);
+            (void)result;
+         }
+         if (err == 0) {
+            return new_socket_handle;
+         }
+         return std::unexpected(err);
+      }
+
+      bool try_accept() noexcept
+      {
+         new_socket_handle = accept4(sock_handle, nullptr, nullptr, SOCK_NONBLOCK);
+         if (new_socket_handle < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            err = errno;
+            accept_done = true;
+            return true;
+         }
+         accept_done = new_socket_handle >= 0;
+         return accept_done;
+      }
+
+      bool accept_done;
+      int sock_handle;
+      int new_socket_handle;
+      int err;
+   };
+
+   return accept_awaiter{false, sock_handle, -1, 0};
+}
+
+// Accepts as many connections as are waiting, up to accepted.size(), once there is at least one, filling accepted
+// with their non-blocking sockets and returning how many there are
+inline auto async_accept(int sock_handle, std::span<int> accepted) noexcept
+{
+   struct accept_batch_awaiter {
+      bool await_ready() noexcept { return accepted.empty() || try_accept(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLIN, sock_handle}; }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (num_accepted == 0 && err == 0 && !accepted.empty()) {
+            const auto result = try_accept();
+            assert(result);
+            (void)result;
+         }
+         if (num_accepted == 0 && err != 0) {
+            return std::unexpected(err);
+         }
+         return num_accepted;
+      }
+
+      // Drains the queue, true once there's something to return
+      bool try_accept() noexcept
+      {
+         while (num_accepted < accepted.size()) {
+            const auto new_socket_handle = accept4(sock_handle, nullptr, nullptr, SOCK_NONBLOCK);
+            if (new_socket_handle < 0) {
+               if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                  // Only reported if nothing was accepted, otherwise it'll happen again on the next call
+                  err = errno;
+               }
+               break;
+            }
+            accepted[num_accepted] = new_socket_handle;
+            num_accepted += 1;
+         }
+         return num_accepted > 0 || err != 0;
+      }
+
+      int sock_handle;
+      std::span<int> accepted;
+      std::size_t num_accepted;
+      int err;
+   };
+
+   return accept_batch_awaiter{sock_handle, accepted, 0, 0};
+}
+
+// Receives up to msgs.size() datagrams with recvmmsg once there's at least one, returning how many; each header's
+// msg_len is set to the size of its datagram (datagram_batch sets the headers up)
+inline auto async_recv_batch(int sock_handle, std::span<mmsghdr> msgs) noexcept
+{
+   struct recv_batch_awaiter {
+      bool await_ready() noexcept { return msgs.empty() || try_recv(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLIN, sock_handle, &on_ready, this}; }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return num_received;
+      }
+
+      // Returns false if there's nothing to receive yet
+      bool try_recv() noexcept
+      {
+         const auto res = recvmmsg(sock_handle, msgs.data(), static_cast<unsigned>(msgs.size()), MSG_DONTWAIT, nullptr);
+         if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               return false;
+            }
+            err = errno;
+            return true;
+         }
+         num_received = static_cast<std::size_t>(res);
+         return true;
+      }
+
+      // Receives before resuming the task, so it stays suspended if another receiver got there first
+      static bool on_ready(void* self) noexcept { return static_cast<recv_batch_awaiter*>(self)->try_recv(); }
+
+      int sock_handle;
+      int err;
+      std::size_t num_received;
+      std::span<mmsghdr> msgs;
+   };
+
+   return recv_batch_awaiter{sock_handle, 0, 0, msgs};
+}
+
+// Sends every datagram in msgs with sendmmsg, waiting for room in the socket's buffer as needed, and returns how
+// many were sent. That's only fewer than msgs.size() if one failed after others were sent; the error is reported
+// if the first one fails.
+inline auto async_send_batch(int sock_handle, std::span<mmsghdr> msgs) noexcept
+{
+   struct send_batch_awaiter {
+      bool await_ready() noexcept { return try_send(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      { h.promise().sock_info_ = {POLLOUT, sock_handle, &on_ready, this}; }
+
+      std::expected<std::size_t, int> await_resume() noexcept
+      {
+         if (err != 0) {
+            return std::unexpected(err);
+         }
+         return num_sent;
+      }
+
+      // Returns false if the socket's buffer fills up before everything is sent
+      bool try_send() noexcept
+      {
+         while (num_sent < msgs.size()) {
+            const auto remaining = msgs.subspan(num_sent);
+            const auto res
+               = sendmmsg(sock_handle, remaining.data(), static_cast<unsigned>(remaining.size()), MSG_DONTWAIT);
+            if (res < 0) {
+               if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                  return false;
+               }
+               if (num_sent == 0) {
+                  err = errno;
+               }
+               return true;
+            }
+            num_sent += static_cast<std::size_t>(res);
+         }
+         return true;
+      }
+
+      // Keeps going after partial sends without resuming the task
+      static bool on_ready(void* self) noexcept { return static_cast<send_batch_awaiter*>(self)->try_send(); }
+
+      int sock_handle;
+      int err;
+      std::size_t num_sent;
+      std::span<mmsghdr> msgs;
+   };
+
+   return send_batch_awaiter{sock_handle, 0, 0, msgs};
+}
+
+// Fails with ETIMEDOUT if awaiter's operation hasn't completed within timeout. Works with any awaiter whose
+// await_resume returns a std::expected with an errno value as the error.
+template<typename Awaiter>
+auto with_timeout(Awaiter awaiter, timer_wheel::clock::duration timeout) noexcept
+{
+   struct timeout_awaiter : timer_node {
+      bool await_ready() noexcept { return inner.await_ready(); }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+         inner.await_suspend(h);
+         task = h;
+         on_expire = &stop_waiting;
+         timer_wheel::this_thread().arm(*this, timeout);
+      }
+
+      auto await_resume() noexcept -> decltype(std::declval<Awaiter&>().await_resume())
+      {
+         if (expired) {
+            return std::unexpected(ETIMEDOUT);
+         }
+         timer_wheel::this_thread().cancel(*this);
+         return inner.await_resume();
+      }
+
+      // Stop the reactor from resuming the task for its socket as well
+      static bool stop_waiting(timer_node& node) noexcept
+      {
+         node.task.promise().sock_info_.events_to_test = 0;
+         return true;
+      }
+
+      Awaiter inner;
+      timer_wheel::clock::duration timeout;
+   };
+   return timeout_awaiter{{}, std::move(awaiter), timeout};
+}
+
+// Keeps every socket registered with one epoll instance instead of rebuilding a pollfd array each iteration.
+// Sockets are registered edge-triggered the first time a task suspends on them and stay registered until the
+// owning task finishes; this is safe because every awaiter attempts its operation before suspending, so an
+// edge can never be missed. Each wakeup only touches the tasks that are ready.
+class epoll_reactor : public reactor_base<epoll_reactor> {
+public:
+   explicit epoll_reactor(std::vector<socket_task>& tasks) noexcept
+      : reactor_base{tasks}
+      , epoll_fd_{epoll_create1(0)}
+      , resolver_fd_{resolver::completion_fd()}
+      , injected_{injection_queue::this_thread()}
+   {
+      assert(epoll_fd_ != -1);
+      for (const int fd : {resolver_fd_, injected_->fd()}) {
+         epoll_event ev;
+         ev.events = EPOLLIN | EPOLLET;
+         ev.data.fd = fd;
+         epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+      }
+   }
+
+   ~epoll_reactor() { close(epoll_fd_); }
+
+   void run() noexcept
+   {
+      adopt_new_tasks();
+      std::array<epoll_event, 256> events;
+      std::vector<socket_task::handle_type> ready;
+      auto& timers = timer_wheel::this_thread();
+      auto& stats = scheduler_stats::this_thread();
+      auto& budget = yield_budget::this_thread();
+      while (!tasks_.empty()) {
+         // Anything left over is retried once epoll reports the socket writable (it's registered for EPOLLOUT)
+         flush_output_queues();
+         // Tasks that yielded are ready already, so only pick up what else is ready
+         std::optional<std::chrono::nanoseconds> timeout = timers.next_timeout();
+         if (budget.has_deferred()) {
+            timeout = std::chrono::nanoseconds{};
+         }
+         int num_events = 0;
+         const auto spin_found = busy_poll(timeout, [&]() {
+            num_events = std::max(0, epoll_wait(epoll_fd_, events.data(), events.size(), 0));
+            return num_events > 0;
+         });
+         if (!spin_found) {
+            if (timeout != std::chrono::nanoseconds{}) {
+               stats.record_sleep();
+            }
+            const auto ts = to_timespec(timeout.value_or(std::chrono::nanoseconds{}));
+            num_events = epoll_pwait2(epoll_fd_, events.data(), events.size(), timeout ? &ts : nullptr, nullptr);
+            if (num_events < 0) {
+               assert(errno == EINTR);
+               num_events = 0;
+            }
+         }
+         const auto ready_since = stats.record_poll(tasks_.size());
+         // Timers go first, a timed out awaiter stops waiting on its socket so the task can't be queued twice
+         ready.clear();
+         timers.expire(ready);
+         resolver::take_completed(ready);
+         take_injected(*injected_, ready);
+         // Look every handle up before resuming any of them; resuming can finish a task and let its fd number
+         // be reused by a new connection in this same batch
+         for (int i = 0; i < num_events; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == resolver_fd_ || fd == injected_->fd()) {
+               continue;
+            }
+            const auto h = owners_[fd];
+            if (!h) {
+               continue;
+            }
+            const auto info = h.promise().sock_info_;
+            const auto wanted = to_epoll_events(info.events_to_test) | EPOLLERR | EPOLLHUP;
+            if (
+               info.handle == fd && info.events_to_test != 0 && (events[i].events & wanted) != 0
+               && (info.on_ready == nullptr || info.on_ready(info.on_ready_context))) {
+               ready.push_back(h);
+            }
+         }
+         budget.take_deferred(ready);
+         resume_ready(ready, ready_since);
+      }
+   }
+
+private:
+   friend reactor_base;
+
+   static std::uint32_t to_epoll_events(short poll_events) noexcept
+   {
+      std::uint32_t to_ret = 0;
+      if (poll_events & POLLIN) {
+         to_ret |= EPOLLIN;
+      }
+      if (poll_events & POLLOUT) {
+         to_ret |= EPOLLOUT;
+      }
+      return to_ret;
+   }
+
+   // Registers the fd the task suspended on if it isn't already registered to it
+   void on_task_suspended(socket_task::handle_type h) noexcept
+   {
+      const auto info = h.promise().sock_info_;
+      if (info.handle < 0 || info.events_to_test == 0) {
+         return;
+      }
+      const auto fd = static_cast<std::size_t>(info.handle);
+      if (fd >= owners_.size()) {
+         owners_.resize(fd + 1);
+      }
+      if (owners_[fd] == h) {
+         return;
+      }
+      owners_[fd] = h;
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = info.handle;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, info.handle, &ev) == -1 && errno == EEXIST) {
+         epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, info.handle, &ev);
+      }
+   }
+
+   void on_task_retired(socket_task::handle_type h) noexcept
+   {
+      const auto fd = h.promise().sock_info_.handle;
+      if (fd >= 0 && static_cast<std::size_t>(fd) < owners_.size() && owners_[fd] == h) {
+         // Closing the fd (done by ~socket_task) removes it from the epoll set
+         owners_[fd] = nullptr;
+      }
+   }
+
+   int epoll_fd_;
+   // Readable when lookups started on this thread have finished, see resolver::take_completed
+   int resolver_fd_;
+   const std::shared_ptr<injection_queue> injected_;
+   // Indexed by fd, the task that fd is currently registered to
+   std::vector<socket_task::handle_type> owners_;
+};
+
+inline void socket_scheduler(std::vector<socket_task>& tasks) noexcept { epoll_reactor{tasks}.run(); }
+
+// Runs tasks on several threads, each with a run queue of ready tasks that idle threads can steal from. Each
+// task has a home worker (the one it was given to or spawned on) whose epoll instance its fd is registered with
+// and which destroys it once it's done, but it can be resumed by any worker. Registrations are EPOLLONESHOT and
+// only re-armed once the task has fully suspended, so a task can never be queued while it's running.
+//
+// Tasks must not add tasks to a vector as server_accept_loop does; use work_stealing_scheduler::spawn instead.
+// Timers (async_sleep and with_timeout), lookups (async_resolve, so async_connect to a name that isn't cached) and
+// the injection_queue (so async_offload) are only driven by socket_scheduler and can't be used here.
+class work_stealing_scheduler {
+public:
+   work_stealing_scheduler(std::vector<socket_task>& tasks, unsigned num_threads)
+   {
+      assert(num_threads > 0);
+      for (unsigned i = 0; i < num_threads; ++i) {
+         workers_.push_back(std::make_unique<worker>());
+      }
+      // Tasks that are already done are never counted as live
+      for (std::size_t i = 0; i < tasks.size(); ++i) {
+         if (!tasks[i].done()) {
+            live_tasks_.fetch_add(1, std::memory_order_relaxed);
+         }
+         workers_[i % num_threads]->tasks.push_back(std::move(tasks[i]));
+      }
+      tasks.clear();
+   }
+
+   work_stealing_scheduler(const work_stealing_scheduler&) = delete;
+   work_stealing_scheduler& operator=(const work_stealing_scheduler&) = delete;
+
+   void run()
+   {
+      if (live_tasks_.load(std::memory_order_relaxed) == 0) {
+         return;
+      }
+      std::vector<std::thread> threads;
+      for (unsigned i = 1; i < workers_.size(); ++i) {
+         threads.emplace_back([this, i]() { worker_loop(i); });
+      }
+      worker_loop(0);
+      for (auto& thread : threads) {
+         thread.join();
+      }
+   }
+
+   // Adds a task to the worker running the calling task
+   static void spawn(socket_task task)
+   {
+      assert(current_scheduler_);
+      auto& self = *current_scheduler_;
+      auto& w = *self.workers_[current_worker_];
+      const auto h = task.handle();
+      if (h.done()) {
+         return;
+      }
+      self.live_tasks_.fetch_add(1, std::memory_order_relaxed);
+      h.promise().home_worker_ = current_worker_;
+      h.promise().task_index_ = w.tasks.size();
+      w.tasks.push_back(std::move(task));
+      self.arm(h);
+   }
+
+private:
+   struct worker {
+      worker() : epoll_fd{epoll_create1(0)}, wake_fd{eventfd(0, EFD_NONBLOCK)}
+      {
+         assert(epoll_fd != -1 && wake_fd != -1);
+         epoll_event ev;
+         ev.events = EPOLLIN;
+         ev.data.ptr = nullptr;
+         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+      }
+
+      worker(const worker&) = delete;
+      worker& operator=(const worker&) = delete;
+
+      ~worker()
+      {
+         close(wake_fd);
+         close(epoll_fd);
+      }
+
+      int epoll_fd;
+      int wake_fd;
+      work_stealing_deque<void*> ready;
+      // Only touched by this worker's thread
+      std::vector<socket_task> tasks;
+      // Tasks owned by this worker that finished on another one, waiting to be destroyed
+      std::mutex finished_mutex;
+      std::vector<socket_task::handle_type> finished;
+      // Tasks that yielded, waiting for the next poll; only touched by the thread running the worker
+      std::vector<socket_task::handle_type> yielded;
+      std::atomic<bool> sleeping{false};
+   };
+
+   void worker_loop(unsigned index)
+   {
+      current_scheduler_ = this;
+      current_worker_ = index;
+      auto& self = *workers_[index];
+      for (std::size_t i = 0; i < self.tasks.size(); ++i) {
+         const auto h = self.tasks[i].handle();
+         h.promise().home_worker_ = index;
+         h.promise().task_index_ = i;
+         if (!h.done()) {
+            arm(h);
+         }
+      }
+      // Tasks that yielded while they were being created
+      queue_deferred(self);
+
+      std::uint32_t rng = index * 2654435761u + 1;
+      while (!stop_.load(std::memory_order_acquire)) {
+         retire_finished(self);
+         requeue_yielded(self);
+         poll(self, 0);
+         while (const auto address = self.ready.pop()) {
+            run_task(self, *address);
+         }
+         if (!self.yielded.empty()) {
+            continue;
+         }
+         if (const auto address = steal(index, rng)) {
+            run_task(self, *address);
+            continue;
+         }
+
+         // Nothing to do; advertise that we're asleep, then look once more so a push racing with this can't be
+         // missed (the pusher checks for sleepers after pushing)
+         self.sleeping.store(true, std::memory_order_seq_cst);
+         num_sleeping_.fetch_add(1, std::memory_order_seq_cst);
+         const auto address = steal(index, rng);
+         if (!address && !stop_.load(std::memory_order_acquire)) {
+            poll(self, -1);
+         }
+         num_sleeping_.fetch_sub(1, std::memory_order_seq_cst);
+         self.sleeping.store(false, std::memory_order_relaxed);
+         if (address) {
+            run_task(self, *address);
+         }
+      }
+      current_scheduler_ = nullptr;
+   }
+
+   // Queues every task whose fd the worker's epoll reports as ready
+   void poll(worker& self, int timeout)
+   {
+      std::array<epoll_event, 256> events;
+      const auto num_events = epoll_wait(self.epoll_fd, events.data(), events.size(), timeout);
+      if (num_events <= 0 && timeout == 0) {
+         // Not a wakeup, so not worth recording
+         return;
+      }
+      auto& stats = scheduler_stats::this_thread();
+      const auto ready_since = stats.record_poll(self.tasks.size());
+      int queued = 0;
+      for (int i = 0; i < num_events; ++i) {
+         if (events[i].data.ptr == nullptr) {
+            std::uint64_t count;
+            (void)!read(self.wake_fd, &count, sizeof(count));
+         }
+         else {
+            auto& promise = socket_task::handle_type::from_address(events[i].data.ptr).promise();
+            promise.ready_since_.store(ready_since, std::memory_order_relaxed);
+            self.ready.push(events[i].data.ptr);
+            queued += 1;
+         }
+      }
+      stats.record_ready(static_cast<std::size_t>(queued));
+      // We can only run one of these at a time, so let a sleeping worker come and take the rest
+      if (queued > 1) {
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (num_sleeping_.load(std::memory_order_seq_cst) > 0) {
+            wake_one();
+         }
+      }
+   }
+
+   std::optional<void*> steal(unsigned index, std::uint32_t& rng)
+   {
+      // xorshift32 to pick where to start looking so thieves don't all hit the same victim
+      rng ^= rng << 13;
+      rng ^= rng >> 17;
+      rng ^= rng << 5;
+      const auto num_workers = static_cast<unsigned>(workers_.size());
+      const auto start = rng % num_workers;
+      for (unsigned i = 0; i < num_workers; ++i) {
+         const auto victim = (start + i) % num_workers;
+         if (victim == index) {
+            continue;
+         }
+         if (const auto address = workers_[victim]->ready.steal()) {
+            return address;
+         }
+      }
+      return std::nullopt;
+   }
+
+   void run_task(worker& self, void* address)
+   {
+      const auto h = socket_task::handle_type::from_address(address);
+      const auto info = h.promise().sock_info_;
+      if (info.on_ready != nullptr && !info.on_ready(info.on_ready_context)) {
+         arm(h);
+         return;
+      }
+      const auto start = scheduler_stats::clock::now();
+      yield_budget::this_thread().reset();
+      h.promise().leaf_.resume();
+      scheduler_stats::this_thread().record_resume(
+         h.promise().ready_since_.load(std::memory_order_relaxed), start, scheduler_stats::clock::now(), info.handle);
+      queue_deferred(self);
+      if (!h.done()) {
+         arm(h);
+         return;
+      }
+      auto& home = *workers_[h.promise().home_worker_];
+      if (&home == &self) {
+         retire(self, h);
+      }
+      else {
+         {
+            std::lock_guard lock{home.finished_mutex};
+            home.finished.push_back(h);
+         }
+         wake(home);
+      }
+      if (live_tasks_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+         stop_.store(true, std::memory_order_release);
+         for (const auto& w : workers_) {
+            wake(*w);
+         }
+      }
+   }
+
+   // Puts tasks that yielded (see yield_budget) aside until the worker next polls
+   static void queue_deferred(worker& self)
+   {
+      auto& budget = yield_budget::this_thread();
+      if (budget.has_deferred()) {
+         budget.take_deferred(self.yielded);
+      }
+   }
+
+   // Queues the tasks put aside by queue_deferred. The worker pops the most recently pushed task first, so this
+   // is done before polling to have the tasks that didn't yield run first; thieves take the yielded ones first.
+   static void requeue_yielded(worker& self)
+   {
+      const auto now = scheduler_stats::clock::now();
+      for (const auto h : self.yielded) {
+         h.promise().ready_since_.store(now, std::memory_order_relaxed);
+         self.ready.push(h.address());
+      }
+      self.yielded.clear();
+   }
+
+   // (Re-)registers the fd the task is waiting on with its home worker's epoll
+   void arm(socket_task::handle_type h)
+   {
+      const auto info = h.promise().sock_info_;
+      if (info.handle < 0 || info.events_to_test == 0) {
+         return;
+      }
+      epoll_event ev;
+      ev.events = EPOLLONESHOT | EPOLLRDHUP;
+      if (info.events_to_test & POLLIN) {
+         ev.events |= EPOLLIN;
+      }
+      if (info.events_to_test & POLLOUT) {
+         ev.events |= EPOLLOUT;
+      }
+      ev.data.ptr = h.address();
+      const auto epoll_fd = workers_[h.promise().home_worker_]->epoll_fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, info.handle, &ev) == -1 && errno == ENOENT) {
+         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, info.handle, &ev);
+      }
+   }
+
+   void retire_finished(worker& self)
+   {
+      std::vector<socket_task::handle_type> finished;
+      {
+         std::lock_guard lock{self.finished_mutex};
+         if (self.finished.empty()) {
+            return;
+         }
+         std::swap(finished, self.finished);
+      }
+      for (const auto h : finished) {
+         retire(self, h);
+      }
+   }
+
+   // Destroys a finished task owned by this worker
+   static void retire(worker& self, socket_task::handle_type h)
+   {
+      const auto index = h.promise().task_index_;
+      socket_task finished = std::move(self.tasks[index]);
+      if (index != self.tasks.size() - 1) {
+         self.tasks[index] = std::move(self.tasks.back());
+         self.tasks[index].handle().promise().task_index_ = index;
+      }
+      self.tasks.pop_back();
+   }
+
+   void wake_one()
+   {
+      for (const auto& w : workers_) {
+         if (w->sleeping.exchange(false, std::memory_order_acq_rel)) {
+            wake(*w);
+            return;
+         }
+      }
+   }
+
+   static void wake(worker& w)
+   {
+      const std::uint64_t one = 1;
+      (void)!write(w.wake_fd, &one, sizeof(one));
+   }
+
+   static inline thread_local work_stealing_scheduler* current_scheduler_ = nullptr;
+   static inline thread_local unsigned current_worker_ = 0;
+
+   std::vector<std::unique_ptr<worker>> workers_;
+   std::atomic<std::size_t> live_tasks_{0};
+   std::atomic<unsigned> num_sleeping_{0};
+   std::atomic<bool> stop_{false};
+};
+
+#endif
+
+// Looks host up with async_resolve and connects to it; errors are errno values, or EAI_ codes if the lookup failed.
+// The strings must stay valid until the co_await finishes.
+inline task<std::expected<int, int>> async_connect(const char* host, const char* port)
+{
+   const auto addresses = co_await async_resolve(host, port);
+   if (!addresses) {
+      co_return std::unexpected(addresses.error());
+   }
+   co_return co_await async_connect(**addresses);
+}
+
+// Buffers for a batch of datagrams along with the headers async_recv_batch and async_send_batch take, so a batch
+// costs one syscall rather than one per datagram. Each datagram has its own buffer and address. Receiving records
+// the sender of each datagram in its address, so a batch that's been received can be echoed back by setting each
+// length to what was received; datagrams on a connected socket are sent without an address.
+class datagram_batch {
+public:
+   datagram_batch(std::size_t count, std::size_t buffer_size)
+      : buffer_size_{buffer_size}
+      , buffers_(std::make_unique<char[]>(count * buffer_size))
+      , iovecs_(count)
+      , addresses_(count)
+      , headers_(count)
+   {
+      for (std::size_t i = 0; i < count; ++i) {
+         iovecs_[i] = {buffers_.get() + i * buffer_size, buffer_size};
+         std::memset(&headers_[i], 0, sizeof(headers_[i]));
+         headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+         headers_[i].msg_hdr.msg_iovlen = 1;
+      }
+   }
+
+   std::size_t size() const noexcept { return headers_.size(); }
+   std::size_t buffer_size() const noexcept { return buffer_size_; }
+
+   std::span<mmsghdr> headers() noexcept { return headers_; }
+
+   // Sets every datagram up to be received into its whole buffer from any address
+   std::span<mmsghdr> prepare_recv() noexcept
+   {
+      for (std::size_t i = 0; i < size(); ++i) {
+         iovecs_[i].iov_len = buffer_size_;
+         headers_[i].msg_hdr.msg_name = &addresses_[i];
+         headers_[i].msg_hdr.msg_namelen = sizeof(addresses_[i]);
+         headers_[i].msg_len = 0;
+      }
+      return headers_;
+   }
+
+   // Datagram i's whole buffer
+   std::span<char> buffer(std::size_t i) noexcept { return {buffers_.get() + i * buffer_size_, buffer_size_}; }
+
+   // The size of datagram i as received
+   std::size_t received(std::size_t i) const noexcept { return headers_[i].msg_len; }
+
+   // How much of datagram i's buffer to send
+   void set_length(std::size_t i, std::size_t length) noexcept
+   {
+      assert(length <= buffer_size_);
+      iovecs_[i].iov_len = length;
+   }
+
+   // Where to send datagram i, nullptr for a connected socket's peer
+   void set_address(std::size_t i, const sockaddr* addr, socklen_t len) noexcept
+   {
+      if (addr == nullptr) {
+         headers_[i].msg_hdr.msg_name = nullptr;
+         headers_[i].msg_hdr.msg_namelen = 0;
+         return;
+      }
+      assert(len <= sizeof(addresses_[i]));
+      std::memcpy(&addresses_[i], addr, len);
+      headers_[i].msg_hdr.msg_name = &addresses_[i];
+      headers_[i].msg_hdr.msg_namelen = len;
+   }
+
+private:
+   std::size_t buffer_size_;
+   std::unique_ptr<char[]> buffers_;
+   std::vector<iovec> iovecs_;
+   std::vector<sockaddr_storage> addresses_;
+   std::vector<mmsghdr> headers_;
+};
+
+// Per-thread pool of the fixed size buffers that buffered_reader and output_queue read into and write from, carved
+// out of page aligned slabs. Connections only hold a buffer while they have unread or unsent data, so memory grows
+// with the number of busy connections rather than open ones. A buffer released on another thread than the one that
+// took it (which happens with work_stealing_scheduler) joins the releasing thread's free list, so slabs belong to
+// the process and are never freed; a thread's free buffers are handed back when it exits for other threads to use.
+class buffer_pool {
+public:
+   static constexpr std::size_t buffer_size = 4096;
+   static constexpr std::size_t buffers_per_slab = 64;
+
+   struct deleter {
+      void operator()(char* buffer) const noexcept { buffer_pool::this_thread().release(buffer); }
+   };
+
+   using buffer = std::unique_ptr<char[], deleter>;
+
+   struct thread_snapshot {
+      // Order in which the threads first used a buffer
+      unsigned thread_index;
+      // Buffers taken on this thread less those released on it, negative if it releases buffers others took
+      std::int64_t in_use;
+      // Most buffers in use on this thread at once
+      std::int64_t high_water;
+      // Slabs this thread has allocated
+      std::uint64_t slabs;
+   };
+
+   static buffer_pool& this_thread() noexcept
+   {
+      thread_local buffer_pool pool;
+      return pool;
+   }
+
+   // Every thread's pool that has been used and whose thread hasn't exited
+   static std::vector<thread_snapshot> snapshot()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      std::vector<thread_snapshot> snapshots;
+      for (const auto* pool : reg.pools) {
+         snapshots.push_back(
+            {pool->thread_index_,
+             static_cast<std::int64_t>(static_cast<std::uint64_t>(pool->in_use_)),
+             static_cast<std::int64_t>(static_cast<std::uint64_t>(pool->high_water_)),
+             pool->slabs_});
+      }
+      return snapshots;
+   }
+
+   buffer_pool(const buffer_pool&) = delete;
+   buffer_pool& operator=(const buffer_pool&) = delete;
+
+   buffer acquire()
+   {
+      if (free_ == nullptr) {
+         refill();
+      }
+      in_use_ += 1;
+      const auto in_use = static_cast<std::int64_t>(static_cast<std::uint64_t>(in_use_));
+      if (in_use > static_cast<std::int64_t>(static_cast<std::uint64_t>(high_water_))) {
+         high_water_ = static_cast<std::uint64_t>(in_use);
+      }
+      auto* const block = std::exchange(free_, free_->next);
+      return buffer{reinterpret_cast<char*>(block)};
+   }
+
+private:
+   struct free_block {
+      free_block* next;
+   };
+
+   // Owns the slabs and keeps track of the pools for snapshot
+   struct registry {
+      static registry& instance() noexcept
+      {
+         static registry reg;
+         return reg;
+      }
+
+      ~registry()
+      {
+         for (auto* slab : slabs) {
+            ::operator delete(slab, buffer_size * buffers_per_slab, std::align_val_t{buffer_size});
+         }
+      }
+
+      std::mutex mutex;
+      std::vector<buffer_pool*> pools;
+      std::vector<void*> slabs;
+      // Free buffers of threads that have exited
+      free_block* orphans = nullptr;
+      unsigned next_index = 0;
+   };
+
+   buffer_pool()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      thread_index_ = reg.next_index++;
+      reg.pools.push_back(this);
+   }
+
+   ~buffer_pool()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      std::erase(reg.pools, this);
+      while (free_ != nullptr) {
+         auto* const block = std::exchange(free_, free_->next);
+         block->next = reg.orphans;
+         reg.orphans = block;
+      }
+   }
+
+   void release(char* buffer) noexcept
+   {
+      free_ = ::new (buffer) free_block{free_};
+      in_use_ -= 1;
+   }
+
+   // Takes up to a slab's worth of buffers other threads left behind, or allocates a new slab
+   void refill()
+   {
+      auto& reg = registry::instance();
+      const std::lock_guard lock{reg.mutex};
+      for (std::size_t i = 0; i < buffers_per_slab && reg.orphans != nullptr; ++i) {
+         auto* const block = std::exchange(reg.orphans, reg.orphans->next);
+         block->next = free_;
+         free_ = block;
+      }
+      if (free_ != nullptr) {
+         return;
+      }
+      // Make room for the slab first so it isn't leaked if either allocation throws
+      reg.slabs.reserve(reg.slabs.size() + 1);
+      auto* const slab = static_cast<char*>(
+         ::operator new(buffer_size * buffers_per_slab, std::align_val_t{buffer_size}));
+      reg.slabs.push_back(slab);
+      slabs_ += 1;
+      for (auto i = buffers_per_slab; i > 0; --i) {
+         free_ = ::new (slab + (i - 1) * buffer_size) free_block{free_};
+      }
+   }
+
+   unsigned thread_index_;
+   free_block* free_ = nullptr;
+   single_writer_counter in_use_;
+   single_writer_counter high_water_;
+   single_writer_counter slabs_;
+};
+
+// Per-connection read buffer. Every read takes as much as is available (up to the capacity) so one read can serve
+// many small messages, and a request is only handed back to the task once it can be satisfied from the buffer.
+// Returned spans point into the buffer and are only valid until the next request on the reader. Errors are errno
+// values, with 0 meaning the peer closed the connection before the request could be satisfied. The buffer comes
+// from buffer_pool once the socket is readable and goes back when a request finds it empty and the socket has
+// nothing more, so a connection waiting for its next message holds no buffer. With io_uring that wait is a poll
+// rather than a receive, as a receive would need the buffer up front.
+class buffered_reader {
+public:
+   static constexpr std::size_t capacity = buffer_pool::buffer_size;
+
+   explicit buffered_reader(int sock_handle) noexcept : sock_handle_{sock_handle} {}
+
+   // Waits for n bytes and consumes them; n must not be larger than the capacity
+   auto read_exact(std::size_t n) noexcept
+   {
+      assert(n <= capacity);
+      return awaiter{*this, n, no_delim, true};
+   }
+
+   // Waits for delim and consumes everything up to and including it; fails with ENOBUFS if the buffer fills first
+   auto read_until(char delim) noexcept { return awaiter{*this, 1, static_cast<unsigned char>(delim), true}; }
+
+   // Waits for n bytes and returns them without consuming them
+   auto peek(std::size_t n) noexcept
+   {
+      assert(n <= capacity);
+      return awaiter{*this, n, no_delim, false};
+   }
+
+   void consume(std::size_t n) noexcept
+   {
+      assert(n <= buffered());
+      begin_ += n;
+   }
+
+   std::size_t buffered() const noexcept { return end_ - begin_; }
+
+   int handle() const noexcept { return sock_handle_; }
+
+private:
+   static constexpr int no_delim = -1;
+
+   struct awaiter {
+      bool await_ready() noexcept
+      {
+#ifdef COROUTINES1_IO_URING
+         if (check_buffer()) {
+            return true;
+         }
+         reader.release_if_empty();
+         if (reader.buffer_ && !reader.make_room(min_size)) {
+            return fail(ENOBUFS);
+         }
+         return false;
+#else
+         return try_complete();
+#endif
+      }
+
+      void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept
+      {
+#ifdef COROUTINES1_IO_URING
+         h.promise().sock_info_ = {0, reader.sock_handle_};
+         comp.task = h;
+         comp.on_complete = &on_complete;
+         comp.context = this;
+         if (reader.buffer_) {
+            queue_recv();
+         }
+         else {
+            queue_poll();
+         }
+#else
+         h.promise().sock_info_ = {POLLIN, reader.sock_handle_, &on_ready, this};
+#endif
+      }
+
+      std::expected<std::span<const char>, int> await_resume() noexcept
+      {
+         if (failed) {
+            return std::unexpected(err);
+         }
+         const std::span<const char> to_ret{reader.buffer_.get() + reader.begin_, length};
+         if (consume) {
+            reader.begin_ += length;
+         }
+         return to_ret;
+      }
+
+      // Sets length and returns true if the request can be served from what's buffered
+      bool check_buffer() noexcept
+      {
+         const auto available = reader.buffered();
+         if (delim == no_delim) {
+            length = min_size;
+            return available >= min_size;
+         }
+         if (available == scanned) {
+            return false;
+         }
+         const auto start = reader.buffer_.get() + reader.begin_;
+         const auto found = static_cast<const char*>(std::memchr(start + scanned, delim, available - scanned));
+         scanned = available;
+         if (found == nullptr) {
+            return false;
+         }
+         length = found - start + 1;
+         return true;
+      }
+
+      bool fail(int error) noexcept
+      {
+         failed = true;
+         err = error;
+         return true;
+      }
+
+#ifdef COROUTINES1_IO_URING
+      void queue_recv() noexcept
+      {
+         polling = false;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_RECV;
+         sqe.fd = reader.sock_handle_;
+         sqe.addr = reinterpret_cast<std::uint64_t>(reader.buffer_.get() + reader.end_);
+         sqe.len = static_cast<std::uint32_t>(capacity - reader.end_);
+      }
+
+      // Waits for the socket to be readable without a buffer
+      void queue_poll() noexcept
+      {
+         polling = true;
+         auto& sqe = io_uring_ring::this_thread().queue(comp);
+         sqe.opcode = IORING_OP_POLL_ADD;
+         sqe.fd = reader.sock_handle_;
+         sqe.poll32_events = POLLIN;
+      }
+
+      // Takes a buffer and reads what the poll found straight away rather than going round the ring again
+      bool on_readable() noexcept
+      {
+         if (!reader.make_room(min_size)) {
+            return fail(ENOBUFS);
+         }
+         const auto num_read
+            = recv(reader.sock_handle_, reader.buffer_.get() + reader.end_, capacity - reader.end_, MSG_DONTWAIT);
+         if (num_read > 0) {
+            reader.end_ += num_read;
+            if (check_buffer()) {
+               return true;
+            }
+            queue_recv();
+            return false;
+         }
+         if (num_read == 0) {
+            return fail(0);
+         }
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            reader.release_if_empty();
+            queue_poll();
+            return false;
+         }
+         return fail(errno);
+      }
+
+      static bool on_complete(io_uring_ring::completion& c) noexcept
+      {
+         auto& self = *static_cast<awaiter*>(c.context);
+         if (self.polling) {
+            return c.result < 0 ? self.fail(-c.result) : self.on_readable();
+         }
+         if (c.result <= 0) {
+            return self.fail(-c.result);
+         }
+         self.reader.end_ += c.result;
+         if (self.check_buffer()) {
+            return true;
+         }
+         if (!self.reader.make_room(self.min_size)) {
+            return self.fail(ENOBUFS);
+         }
+         self.queue_recv();
+         return false;
+      }
+#else
+      // Reads until the request can be satisfied or the socket would block; returns false in the latter case
+      bool try_complete() noexcept
+      {
+         while (!check_buffer()) {
+            if (!reader.make_room(min_size)) {
+               return fail(ENOBUFS);
+            }
+            const auto num_read
+               = read(reader.sock_handle_, reader.buffer_.get() + reader.end_, capacity - reader.end_);
+            if (num_read > 0) {
+               reader.end_ += num_read;
+            }
+            else if (num_read == 0) {
+               return fail(0);
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               reader.release_if_empty();
+               return false;
+            }
+            else {
+               return fail(errno);
+            }
+         }
+         return true;
+      }
+
+      static bool on_ready(void* self) noexcept { return static_cast<awaiter*>(self)->try_complete(); }
+#endif
+
+      buffered_reader& reader;
+      std::size_t min_size;
+      int delim;
+      bool consume;
+      bool failed = false;
+      int err = 0;
+      std::size_t length = 0;
+      // How much of the buffer has been searched for delim
+      std::size_t scanned = 0;
+#ifdef COROUTINES1_IO_URING
+      io_uring_ring::completion comp = {};
+      // Whether comp is a poll rather than a receive
+      bool polling = false;
+#endif
+   };
+
+   // Takes a buffer if there isn't one. Otherwise moves the unread data to the front of the buffer if needed to fit
+   // at least min_size bytes contiguously and have space to read into; returns false if there's no space to read
+   // into, which includes the pool failing to allocate a new slab.
+   bool make_room(std::size_t min_size) noexcept
+   {
+      if (!buffer_) {
+         try {
+            buffer_ = buffer_pool::this_thread().acquire();
+         }
+         catch (const std::bad_alloc&) {
+            return false;
+         }
+         begin_ = 0;
+         end_ = 0;
+      }
+      else if (begin_ == end_) {
+         begin_ = 0;
+         end_ = 0;
+      }
+      else if (begin_ > 0 && (end_ == capacity || capacity - begin_ < min_size)) {
+         std::memmove(buffer_.get(), buffer_.get() + begin_, end_ - begin_);
+         end_ -= begin_;
+         begin_ = 0;
+      }
+      return end_ < capacity;
+   }
+
+   // Gives the buffer back to the pool if everything in it has been consumed
+   void release_if_empty() noexcept
+   {
+      if (buffer_ && begin_ == end_) {
+         buffer_.reset();
+         begin_ = 0;
+         end_ = 0;
+      }
+   }
+
+   buffer_pool::buffer buffer_;
+   std::size_t begin_ = 0;
+   std::size_t end_ = 0;
+   int sock_handle_;
+};
+
+// Per-connection output buffer. Writes are copied in and everything pending is sent with one writev just before
+// the reactor next waits, so all the replies a task makes in a scheduler turn cost a single syscall. Blocks come
+// from buffer_pool and go back once they've been sent. Only usable with socket_scheduler.
+class output_queue {
+public:
+   explicit output_queue(int sock_handle) noexcept : sock_handle_{sock_handle} {}
+
+   output_queue(const output_queue&) = delete;
+   output_queue& operator=(const output_queue&) = delete;
+
+   ~output_queue() { stop_flushing(); }
+
+   // Returns the error that stopped an earlier flush, if any; once one has happened nothing more is written
+   std::expected<void, int> write(std::span<const char> data)
+   {
+      if (err_ != 0) {
+         return std::unexpected(err_);
+      }
+      while (!data.empty()) {
+         if (blocks_.empty() || last_end_ == block_size) {
+            add_block();
+         }
+         const auto to_copy = std::min(data.size(), block_size - last_end_);
+         std::memcpy(blocks_.back().get() + last_end_, data.data(), to_copy);
+         last_end_ += to_copy;
+         pending_ += to_copy;
+         data = data.subspan(to_copy);
+      }
+      mark_dirty();
+      return {};
+   }
+
+   std::size_t pending() const noexcept { return pending_; }
+
+   // Waits until everything written so far has been sent; use it to bound how much can be queued and before the
+   // queue is destroyed, otherwise unsent data is dropped. The queue isn't flushed while the write is in flight,
+   // as that would send the same bytes again, and anything written meanwhile is flushed once it's done.
+   auto drain() noexcept
+   {
+      struct drain_awaiter {
+         bool await_ready() noexcept
+         {
+            if (queue.err_ != 0 || queue.pending_ == 0) {
+               return true;
+            }
+            queue.stop_flushing();
+            queue.draining_ = true;
+            queue.fill_iovecs(iov);
+            inner.emplace(async_writev(queue.sock_handle_, iov));
+            return inner->await_ready();
+         }
+
+         void await_suspend(std::coroutine_handle<socket_task::promise_type> h) noexcept { inner->await_suspend(h); }
+
+         std::expected<void, int> await_resume() noexcept
+         {
+            if (inner) {
+               queue.draining_ = false;
+               const auto result = inner->await_resume();
+               if (result) {
+                  queue.consume(result.value());
+                  queue.mark_dirty();
+               }
+               else {
+                  queue.fail(result.error());
+               }
+            }
+            if (queue.err_ != 0) {
+               return std::unexpected(queue.err_);
+            }
+            return {};
+         }
+
+         output_queue& queue;
+         // Its own, as the write changes them as it goes
+         std::vector<iovec> iov;
+         std::optional<decltype(async_writev(0, {}))> inner;
+      };
+      return drain_awaiter{*this, {}, std::nullopt};
+   }
+
+private:
+   friend bool flush_output_queues() noexcept;
+
+   static constexpr std::size_t block_size = buffer_pool::buffer_size;
+   static constexpr std::size_t not_dirty = -1;
+
+   // Queues with something to send on this thread
+   static std::vector<output_queue*>& dirty_queues() noexcept
+   {
+      thread_local std::vector<output_queue*> queues;
+      return queues;
+   }
+
+   // Tries to send everything pending; returns true if the socket wouldn't take all of it
+   bool flush() noexcept
+   {
+      fill_iovecs(iov_);
+      const auto num_written
+         = writev(sock_handle_, iov_.data(), static_cast<int>(std::min<std::size_t>(iov_.size(), IOV_MAX)));
+      if (num_written < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+         }
+         fail(errno);
+         return false;
+      }
+      consume(num_written);
+      return pending_ > 0;
+   }
+
+   void fill_iovecs(std::vector<iovec>& iov) const
+   {
+      iov.clear();
+      for (std::size_t i = 0; i < blocks_.size(); ++i) {
+         const auto begin = i == 0 ? first_begin_ : 0;
+         const auto end = i == blocks_.size() - 1 ? last_end_ : block_size;
+         iov.push_back({blocks_[i].get() + begin, end - begin});
+      }
+   }
+
+   // Has flush_output_queues send what's pending, unless a drain is already sending it
+   void mark_dirty()
+   {
+      if (pending_ > 0 && !draining_ && dirty_index_ == not_dirty) {
+         dirty_index_ = dirty_queues().size();
+         dirty_queues().push_back(this);
+      }
+   }
+
+   // Releases num_bytes from the front, giving emptied blocks back to the pool
+   void consume(std::size_t num_bytes) noexcept
+   {
+      pending_ -= num_bytes;
+      num_bytes += first_begin_;
+      std::size_t num_done = 0;
+      while (num_done < blocks_.size() - 1 && num_bytes >= block_size) {
+         num_bytes -= block_size;
+         num_done += 1;
+      }
+      first_begin_ = num_bytes;
+      if (pending_ == 0) {
+         // Everything has been sent, so an idle connection holds no blocks
+         num_done = blocks_.size();
+         first_begin_ = 0;
+         last_end_ = 0;
+         stop_flushing();
+      }
+      blocks_.erase(blocks_.begin(), blocks_.begin() + num_done);
+   }
+
+   void fail(int error) noexcept
+   {
+      err_ = error;
+      pending_ = 0;
+      blocks_.clear();
+      first_begin_ = 0;
+      last_end_ = 0;
+      stop_flushing();
+   }
+
+   void add_block()
+   {
+      blocks_.push_back(buffer_pool::this_thread().acquire());
+      last_end_ = 0;
+   }
+
+   void stop_flushing() noexcept
+   {
+      if (dirty_index_ == not_dirty) {
+         return;
+      }
+      auto& queues = dirty_queues();
+      queues[dirty_index_] = queues.back();
+      queues[dirty_index_]->dirty_index_ = dirty_index_;
+      queues.pop_back();
+      dirty_index_ = not_dirty;
+   }
+
+   int sock_handle_;
+   int err_ = 0;
+   std::size_t pending_ = 0;
+   // Pending data starts at first_begin_ in the first block and ends at last_end_ in the last one
+   std::vector<buffer_pool::buffer> blocks_;
+   std::size_t first_begin_ = 0;
+   std::size_t last_end_ = 0;
+   std::vector<iovec> iov_;
+   std::size_t dirty_index_ = not_dirty;
+   bool draining_ = false;
+};
+
+inline bool flush_output_queues() noexcept
+{
+   auto& queues = output_queue::dirty_queues();
+   bool output_left = false;
+   // Go backwards as fully flushed queues remove themselves by swapping with the last one
+   for (auto i = queues.size(); i > 0; --i) {
+      if (queues[i - 1]->flush()) {
+         output_left = true;
       }
-      std::erase_if(tasks, [](const auto& task) { return task.done(); });
    }
+   return output_left;
 }
 
 #endif // COROUTINE_LIB_HPP
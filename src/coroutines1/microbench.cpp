@@ -0,0 +1,428 @@
+#include "lib.hpp"
+
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Per-operation costs of the coroutine library on its own, over socketpairs and pipes so the kernel does as little
+// as possible: suspending and resuming, co_awaiting the socket awaiters, one scheduler turn as the number of tasks
+// grows, and allocating frames. Prints one CSV row per measurement (benchmark, backend, tasks, operations,
+// ns_per_op) to be compared across commits; each is the best of several runs to keep noise down.
+
+using clock_type = std::chrono::steady_clock;
+
+#ifdef COROUTINES1_IO_URING
+constexpr const char* backend = "io_uring";
+// Its reads and writes are IORING_OP_RECV and IORING_OP_SEND, which only work on sockets
+constexpr std::array use_pipes{false};
+#else
+constexpr const char* backend = "epoll";
+constexpr std::array use_pipes{false, true};
+#endif
+
+struct bench_options {
+   std::size_t max_tasks = 1'000'000;
+   int runs = 5;
+   // Only the groups of benchmarks whose name contains this are run
+   std::string_view filter;
+};
+
+// Runs body runs times and returns the fastest time per operation. body does operations operations and returns
+// how long they took, so it can leave out its setup and teardown.
+template<typename Body>
+double best_ns_per_op(const bench_options& options, std::uint64_t operations, Body&& body)
+{
+   auto best = clock_type::duration::max();
+   for (int i = 0; i < options.runs; ++i) {
+      best = std::min<clock_type::duration>(best, body());
+   }
+   return std::chrono::duration<double, std::nano>{best}.count() / static_cast<double>(operations);
+}
+
+void report(std::string_view name, std::size_t num_tasks, std::uint64_t operations, double ns_per_op)
+{
+   std::cout << name << ',' << backend << ',' << num_tasks << ',' << operations << ',' << ns_per_op << '\n';
+}
+
+// Creates tasks with make_tasks and runs them to completion on this thread, returning how long that took. A task
+// runs from when it's created until it first suspends, so creating them is part of what's timed.
+template<typename MakeTasks>
+clock_type::duration time_tasks(MakeTasks&& make_tasks)
+{
+   std::vector<socket_task> tasks;
+   const auto start = clock_type::now();
+   make_tasks(tasks);
+   socket_scheduler(tasks);
+   return clock_type::now() - start;
+}
+
+// Always ready, so co_awaiting it is only the cost of the await machinery (including the yield_budget)
+struct ready_awaiter {
+   bool await_ready() const noexcept { return true; }
+   void await_suspend(std::coroutine_handle<socket_task::promise_type>) const noexcept {}
+   int await_resume() const noexcept { return 1; }
+};
+
+// Suspends until it's resumed through the injection_queue, without waiting on a socket or timer
+struct park_awaiter {
+   bool await_ready() const noexcept { return false; }
+
+   void await_suspend(std::coroutine_handle<socket_task::promise_type> h)
+   {
+      h.promise().sock_info_.events_to_test = 0;
+      parked.push_back(h);
+   }
+
+   void await_resume() const noexcept {}
+
+   std::vector<socket_task::handle_type>& parked;
+};
+
+// The smallest coroutine type there is, for the cost of a bare resume and suspend without a scheduler
+struct bare_coroutine {
+   struct promise_type {
+      bare_coroutine get_return_object() noexcept
+      { return bare_coroutine{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept {}
+   };
+
+   explicit bare_coroutine(std::coroutine_handle<promise_type> h) noexcept : handle{h} {}
+   bare_coroutine(bare_coroutine&& other) noexcept : handle{std::exchange(other.handle, nullptr)} {}
+   ~bare_coroutine()
+   {
+      if (handle) {
+         handle.destroy();
+      }
+   }
+
+   std::coroutine_handle<promise_type> handle;
+};
+
+bare_coroutine suspend_forever()
+{
+   while (true) {
+      co_await std::suspend_always{};
+   }
+}
+
+socket_task yield_loop(std::uint64_t rounds)
+{
+   for (std::uint64_t i = 0; i < rounds; ++i) {
+      co_await yield();
+   }
+}
+
+socket_task await_ready_loop(std::uint64_t rounds, int& sink)
+{
+   for (std::uint64_t i = 0; i < rounds; ++i) {
+      sink += co_await ready_awaiter{};
+   }
+}
+
+task<int> return_immediately(int value) { co_return value; }
+
+socket_task await_task_loop(std::uint64_t rounds, int& sink)
+{
+   for (std::uint64_t i = 0; i < rounds; ++i) {
+      sink += co_await return_immediately(1);
+   }
+}
+
+// Writes 8 bytes to write_fd and reads them back from read_fd each round, which never has to wait with epoll
+socket_task write_read_loop(int write_fd, int read_fd, std::uint64_t rounds)
+{
+   std::uint64_t value = 0;
+   for (std::uint64_t i = 0; i < rounds; ++i) {
+      const auto res1 = co_await async_write(write_fd, reinterpret_cast<const char*>(&value), sizeof(value));
+      const auto res2 = co_await async_read(read_fd, reinterpret_cast<char*>(&value), sizeof(value));
+      if (!res1 || !res2) {
+         std::cerr << "Write or read failed\n";
+         co_return;
+      }
+   }
+}
+
+// One side of a ping-pong: waits for 8 bytes on read_fd and sends them back on write_fd, starting with a send if
+// it's the initiator. Every round is a suspension and a trip through the scheduler on each side. Once it's done
+// it records when in done_at and resumes the tasks in to_wake, if given.
+socket_task ping_pong(
+   int read_fd, int write_fd, std::uint64_t rounds, bool initiator, clock_type::time_point* done_at = nullptr,
+   const std::vector<socket_task::handle_type>* to_wake = nullptr)
+{
+   std::uint64_t value = 0;
+   for (std::uint64_t i = 0; i < rounds; ++i) {
+      if (initiator) {
+         co_await async_write(write_fd, reinterpret_cast<const char*>(&value), sizeof(value));
+      }
+      const auto res = co_await async_read(read_fd, reinterpret_cast<char*>(&value), sizeof(value));
+      if (!res || res.value() == 0) {
+         std::cerr << "Read failed\n";
+         co_return;
+      }
+      if (!initiator) {
+         co_await async_write(write_fd, reinterpret_cast<const char*>(&value), sizeof(value));
+      }
+   }
+   if (done_at) {
+      *done_at = clock_type::now();
+   }
+   if (to_wake) {
+      for (const auto h : *to_wake) {
+         injection_queue::this_thread()->resume(h);
+      }
+   }
+}
+
+socket_task idle(std::vector<socket_task::handle_type>& parked) { co_await park_awaiter{parked}; }
+
+socket_task finish_immediately() { co_return; }
+
+// Makes a pair of connected fds: a socketpair, or a pipe (read end first)
+std::array<int, 2> make_pair(bool use_pipe)
+{
+   std::array<int, 2> fds{-1, -1};
+   const auto res
+      = use_pipe ? pipe2(fds.data(), O_NONBLOCK) : socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds.data());
+   if (res < 0) {
+      std::cerr << "Creating a " << (use_pipe ? "pipe" : "socketpair") << " failed\n";
+      std::exit(1);
+   }
+   return fds;
+}
+
+// A finished task has closed the fd it last waited on, if it ever waited, so the rest are closed after the run
+void close_if_open(std::span<const int> fds)
+{
+   for (const int fd : fds) {
+      if (fcntl(fd, F_GETFD) != -1) {
+         close(fd);
+      }
+   }
+}
+
+void bench_suspend_resume(const bench_options& options)
+{
+   constexpr std::uint64_t rounds = 1'000'000;
+   {
+      auto coro = suspend_forever();
+      report("bare_resume", 1, rounds, best_ns_per_op(options, rounds, [&]() {
+                const auto start = clock_type::now();
+                for (std::uint64_t i = 0; i < rounds; ++i) {
+                   coro.handle.resume();
+                }
+                return clock_type::now() - start;
+             }));
+   }
+   report("yield_resume", 1, rounds, best_ns_per_op(options, rounds, [&]() {
+             return time_tasks([&](auto& tasks) { tasks.push_back(yield_loop(rounds)); });
+          }));
+   for (const bool use_pipe : use_pipes) {
+      constexpr std::uint64_t pong_rounds = 100'000;
+      report(use_pipe ? "ping_pong_pipe" : "ping_pong_socketpair", 2, pong_rounds,
+         best_ns_per_op(options, pong_rounds, [&]() {
+            // Socketpairs are bidirectional, pipes need one each way
+            const auto a = make_pair(use_pipe);
+            const auto b = use_pipe ? make_pair(true) : std::array{a[1], a[0]};
+            const auto elapsed = time_tasks([&](auto& tasks) {
+               tasks.push_back(ping_pong(a[0], b[1], pong_rounds, true));
+               tasks.push_back(ping_pong(b[0], a[1], pong_rounds, false));
+            });
+            close_if_open(a);
+            close_if_open(b);
+            return elapsed;
+         }));
+   }
+}
+
+void bench_awaiters(const bench_options& options)
+{
+   constexpr std::uint64_t rounds = 1'000'000;
+   int sink = 0;
+   report("await_ready_awaiter", 1, rounds, best_ns_per_op(options, rounds, [&]() {
+             return time_tasks([&](auto& tasks) { tasks.push_back(await_ready_loop(rounds, sink)); });
+          }));
+   report("await_task", 1, rounds, best_ns_per_op(options, rounds, [&]() {
+             return time_tasks([&](auto& tasks) { tasks.push_back(await_task_loop(rounds, sink)); });
+          }));
+   for (const bool use_pipe : use_pipes) {
+      constexpr std::uint64_t io_rounds = 200'000;
+      // The same writes and reads without coroutines, to subtract from the awaiters' cost
+      report(use_pipe ? "syscall_write_read_pipe" : "syscall_write_read_socketpair", 0, io_rounds,
+         best_ns_per_op(options, io_rounds, [&]() {
+            const auto fds = make_pair(use_pipe);
+            std::uint64_t value = 0;
+            const auto start = clock_type::now();
+            for (std::uint64_t i = 0; i < io_rounds; ++i) {
+               (void)!write(fds[1], &value, sizeof(value));
+               (void)!read(fds[0], &value, sizeof(value));
+            }
+            const auto elapsed = clock_type::now() - start;
+            close(fds[0]);
+            close(fds[1]);
+            return elapsed;
+         }));
+      report(use_pipe ? "await_write_read_pipe" : "await_write_read_socketpair", 1, io_rounds,
+         best_ns_per_op(options, io_rounds, [&]() {
+            const auto fds = make_pair(use_pipe);
+            const auto elapsed
+               = time_tasks([&](auto& tasks) { tasks.push_back(write_read_loop(fds[1], fds[0], io_rounds)); });
+            close_if_open(fds);
+            return elapsed;
+         }));
+   }
+   if (sink == 0) {
+      std::cerr << "Nothing was awaited\n";
+   }
+}
+
+void bench_scheduler_scaling(const bench_options& options)
+{
+   // About the same number of resumes at every size
+   constexpr std::uint64_t total_resumes = 2'000'000;
+   constexpr std::uint64_t pong_rounds = 20'000;
+   for (std::size_t num_tasks = 1; num_tasks <= options.max_tasks; num_tasks *= 10) {
+      // Every task is ready every turn, so this is the cost of going round them
+      const auto rounds = std::max<std::uint64_t>(1, total_resumes / num_tasks);
+      report("yield_round_robin", num_tasks, rounds * num_tasks, best_ns_per_op(options, rounds * num_tasks, [&]() {
+                // Each task runs up to its first yield when it's created, so only the scheduler is timed
+                std::vector<socket_task> tasks;
+                tasks.reserve(num_tasks);
+                for (std::size_t i = 0; i < num_tasks; ++i) {
+                   tasks.push_back(yield_loop(rounds));
+                }
+                const auto start = clock_type::now();
+                socket_scheduler(tasks);
+                return clock_type::now() - start;
+             }));
+      // Only one pair of tasks is ever ready, the rest are suspended: a turn shouldn't cost more with more of them
+      report("ping_pong_with_idle_tasks", num_tasks, pong_rounds, best_ns_per_op(options, pong_rounds, [&]() {
+                std::vector<socket_task::handle_type> parked;
+                parked.reserve(num_tasks);
+                std::vector<socket_task> tasks;
+                tasks.reserve(num_tasks + 2);
+                for (std::size_t i = 0; i < num_tasks; ++i) {
+                   tasks.push_back(idle(parked));
+                }
+                // Timed until the ping-pong is done, not counting waking the idle tasks so the scheduler can finish
+                auto done_at = clock_type::time_point{};
+                const auto fds = make_pair(false);
+                const auto start = clock_type::now();
+                tasks.push_back(ping_pong(fds[0], fds[0], pong_rounds, true, &done_at, &parked));
+                tasks.push_back(ping_pong(fds[1], fds[1], pong_rounds, false));
+                socket_scheduler(tasks);
+                close_if_open(fds);
+                return done_at - start;
+             }));
+   }
+}
+
+void bench_frames(const bench_options& options)
+{
+   constexpr std::uint64_t rounds = 1'000'000;
+   // A size class that socket_task frames fall in
+   constexpr std::size_t frame_size = 256;
+   report("frame_alloc_pooled", 0, rounds, best_ns_per_op(options, rounds, [&]() {
+             const auto start = clock_type::now();
+             for (std::uint64_t i = 0; i < rounds; ++i) {
+                void* frame = pooled_frame_allocator::allocate(frame_size);
+                // Stop the pair from being optimised away
+                asm volatile("" : : "r"(frame) : "memory");
+                pooled_frame_allocator::deallocate(frame, frame_size);
+             }
+             return clock_type::now() - start;
+          }));
+   report("frame_alloc_global", 0, rounds, best_ns_per_op(options, rounds, [&]() {
+             const auto start = clock_type::now();
+             for (std::uint64_t i = 0; i < rounds; ++i) {
+                void* frame = global_frame_allocator::allocate(frame_size);
+                asm volatile("" : : "r"(frame) : "memory");
+                global_frame_allocator::deallocate(frame, frame_size);
+             }
+             return clock_type::now() - start;
+          }));
+   // Creating a socket_task runs it, so this is allocating, running to the end and destroying the frame
+   report("socket_task_create_destroy", 1, rounds, best_ns_per_op(options, rounds, [&]() {
+             const auto start = clock_type::now();
+             for (std::uint64_t i = 0; i < rounds; ++i) {
+                const auto t = finish_immediately();
+             }
+             return clock_type::now() - start;
+          }));
+   // Frames of live tasks can't be reused, so this is the cost when the pool has to grow
+   constexpr std::size_t live_tasks = 100'000;
+   report("socket_task_create_live", live_tasks, live_tasks, best_ns_per_op(options, live_tasks, [&]() {
+             std::vector<socket_task::handle_type> parked;
+             parked.reserve(live_tasks);
+             std::vector<socket_task> tasks;
+             tasks.reserve(live_tasks);
+             const auto start = clock_type::now();
+             for (std::size_t i = 0; i < live_tasks; ++i) {
+                tasks.push_back(idle(parked));
+             }
+             return clock_type::now() - start;
+          }));
+}
+
+int main(int argc, const char* argv[])
+{
+   std::signal(SIGPIPE, SIG_IGN);
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " [--max-tasks n] [--runs n] [--filter suspend_resume|awaiters|scheduler_scaling|frames]\n";
+      return 2;
+   };
+   bench_options options;
+   for (int i = 1; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (i + 1 == argc) {
+         return usage();
+      }
+      i += 1;
+      if (arg == "--max-tasks") {
+         const auto max_tasks = std::atoll(argv[i]);
+         if (max_tasks <= 0) {
+            std::cerr << "Error parsing max tasks\n";
+            return 2;
+         }
+         options.max_tasks = static_cast<std::size_t>(max_tasks);
+      }
+      else if (arg == "--runs") {
+         options.runs = std::atoi(argv[i]);
+         if (options.runs <= 0) {
+            std::cerr << "Error parsing runs\n";
+            return 2;
+         }
+      }
+      else if (arg == "--filter") {
+         options.filter = argv[i];
+      }
+      else {
+         return usage();
+      }
+   }
+
+   // Every awaiter that's ready counts against the budget, which would turn awaiter benchmarks into yield ones
+   yield_budget::this_thread().set_limit(0);
+   std::cout << "benchmark,backend,tasks,operations,ns_per_op\n";
+   const std::pair<std::string_view, void (*)(const bench_options&)> groups[] = {
+      {"suspend_resume", bench_suspend_resume},
+      {"awaiters", bench_awaiters},
+      {"scheduler_scaling", bench_scheduler_scaling},
+      {"frames", bench_frames},
+   };
+   for (const auto& [name, run] : groups) {
+      if (name.find(options.filter) != std::string_view::npos) {
+         run(options);
+      }
+   }
+}
@@ -0,0 +1,86 @@
+#include "lib.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Writes far more than a socketpair's send buffer holds through an output_queue, draining it whenever enough is
+// queued the way coroutines1_server does, while the other end reads slowly. Every drain has to wait on the socket
+// with the queue still having been written to that turn, which is when flush_output_queues could send the same
+// bytes a second time. Exits with 1 unless the reader gets exactly the bytes written, in order, and nothing more.
+
+// Exits straight away, as the other task could be left waiting forever
+[[noreturn]] void fail(const char* message, std::size_t position)
+{
+   std::cerr << message << ' ' << position << '\n';
+   std::exit(1);
+}
+
+constexpr std::size_t total_size = 16 << 20;
+constexpr std::size_t max_queued = 64 * 1024;
+
+// Position dependent, with a period that doesn't divide the queue's block size, so repeated or skipped bytes show
+std::uint8_t expected_byte(std::size_t position) noexcept { return static_cast<std::uint8_t>(position % 251); }
+
+socket_task writer(int sock_handle)
+{
+   output_queue output{sock_handle};
+   std::vector<char> message;
+   std::size_t written = 0;
+   for (std::size_t i = 0; written < total_size; ++i) {
+      // Sizes that don't line up with the blocks either
+      message.resize(std::min(total_size - written, 1 + (i * 7919) % 5000));
+      for (auto& c : message) {
+         c = static_cast<char>(expected_byte(written++));
+      }
+      if (!output.write(message)) {
+         fail("Write failed at", written);
+      }
+      if (output.pending() >= max_queued && !co_await output.drain()) {
+         fail("Drain failed at", written);
+      }
+   }
+   if (!co_await output.drain()) {
+      fail("Drain failed at", written);
+   }
+}
+
+socket_task reader(int sock_handle)
+{
+   std::array<char, 4096> buffer;
+   std::size_t received = 0;
+   while (received < total_size) {
+      const auto res = co_await async_read(sock_handle, buffer.data(), std::min(buffer.size(), total_size - received));
+      if (!res || res.value() == 0) {
+         fail("Read failed at", received);
+      }
+      for (int i = 0; i < res.value(); ++i) {
+         if (static_cast<std::uint8_t>(buffer[i]) != expected_byte(received)) {
+            fail("Wrong byte at", received);
+         }
+         received += 1;
+      }
+      // Let the writer get ahead so its socket buffer fills up
+      co_await yield();
+   }
+   // Bytes sent twice would have shown up as wrong ones by now, unless they came after everything else
+   if (recv(sock_handle, buffer.data(), buffer.size(), MSG_DONTWAIT) > 0) {
+      fail("More bytes were sent than the", total_size);
+   }
+}
+
+int main()
+{
+   std::array<int, 2> fds;
+   if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds.data()) < 0) {
+      std::cerr << "Creating a socketpair failed\n";
+      return 1;
+   }
+   std::vector<socket_task> tasks;
+   tasks.push_back(writer(fds[0]));
+   tasks.push_back(reader(fds[1]));
+   socket_scheduler(tasks);
+   std::cout << "Received all " << total_size << " bytes intact\n";
+}
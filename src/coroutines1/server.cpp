@@ -1,70 +1,223 @@
 #include "lib.hpp"
 
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <csignal>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-socket_task server_task(int sock_handle)
+// Connections that don't start a new message for this long are closed
+constexpr auto idle_timeout = std::chrono::seconds{60};
+
+// Replies are only waited on once this much is queued
+constexpr std::size_t max_queued_output = 64 * 1024;
+
+// Most connections taken off the accept queue per wakeup
+constexpr std::size_t max_accept_batch = 64;
+
+// Connections open across all threads. With a limit, accept loops claim slots before accepting and stop
+// accepting while there are none left, leaving new connections in the kernel's accept queue.
+class connection_limit {
+public:
+   // 0 for no limit
+   explicit connection_limit(int max) noexcept : max_{max} {}
+
+   int max() const noexcept { return max_; }
+   int open() const noexcept { return open_.load(std::memory_order_relaxed); }
+
+   // Claims up to wanted slots and returns how many it got
+   std::size_t claim(std::size_t wanted) noexcept
+   {
+      if (max_ == 0) {
+         return wanted;
+      }
+      auto current = open_.load(std::memory_order_relaxed);
+      while (true) {
+         const auto available = std::min<std::size_t>(wanted, current < max_ ? max_ - current : 0);
+         if (available == 0) {
+            return 0;
+         }
+         if (open_.compare_exchange_weak(current, current + static_cast<int>(available), std::memory_order_relaxed)) {
+            return available;
+         }
+      }
+   }
+
+   // Called after accepting with claimed slots, which keeps the slots used and hands back the rest
+   void settle(std::size_t claimed, std::size_t used) noexcept
+   {
+      if (max_ == 0) {
+         open_.fetch_add(static_cast<int>(used), std::memory_order_relaxed);
+      }
+      else {
+         open_.fetch_sub(static_cast<int>(claimed - used), std::memory_order_relaxed);
+      }
+   }
+
+   void release() noexcept { open_.fetch_sub(1, std::memory_order_relaxed); }
+
+private:
+   int max_;
+   std::atomic<int> open_{0};
+};
+
+// Gives a connection's slot back when its task finishes or is destroyed
+class connection_slot {
+public:
+   explicit connection_slot(connection_limit& limit) noexcept : limit_{limit} {}
+   connection_slot(const connection_slot&) = delete;
+   connection_slot& operator=(const connection_slot&) = delete;
+   ~connection_slot() { limit_.release(); }
+
+private:
+   connection_limit& limit_;
+};
+
+// What a thread's accept loop has done, for sizing the backlog and the connection limit
+struct accept_stats {
+   single_writer_counter accepted;
+   single_writer_counter batches;
+   single_writer_counter largest_batch;
+   single_writer_counter errors;
+   // Times accepting stopped because the connection limit was reached
+   single_writer_counter pauses;
+};
+
+// A thread's listening socket and what's been accepted from it
+struct listener {
+   int socket = -1;
+   accept_stats stats;
+};
+
+// Reads one message: a byte that's the number of bytes that follow, then those bytes. The span is valid until the
+// next read from reader.
+task<std::expected<std::span<const char>, int>> read_message(buffered_reader& reader)
 {
+   const auto res1 = co_await with_timeout(reader.read_exact(1), idle_timeout);
+   if (!res1) {
+      co_return std::unexpected{res1.error()};
+   }
+   const unsigned char bytes_to_read = res1.value()[0];
+   co_return co_await reader.read_exact(bytes_to_read);
+}
+
+socket_task server_task(int sock_handle, connection_limit& limit)
+{
+   const connection_slot slot{limit};
+   buffered_reader reader{sock_handle};
+   output_queue output{sock_handle};
    while (true) {
-      // Read 1 byte that's the number of bytes to read
-      char bytes_to_read_raw;
-      const auto res1 = co_await async_read(sock_handle, &bytes_to_read_raw, 1);
-      if (!res1 || res1.value() == 0) {
+      const auto res1 = co_await read_message(reader);
+      if (!res1) {
+         // Send whatever replies are still queued before closing
+         co_await output.drain();
          co_return;
       }
 
-      // Read that many bytes now
-      const unsigned char bytes_to_read = bytes_to_read_raw;
-      std::vector<char> buffer(bytes_to_read);
-      const auto res2 = co_await async_read(sock_handle, buffer.data(), buffer.size());
+      // Queue those bytes to be written back, all replies made this scheduler turn are sent together
+      const auto res2 = output.write(res1.value());
       if (!res2) {
          co_return;
       }
-
-      // Write those bytes back
-      const auto res3 = co_await async_write(sock_handle, buffer.data(), buffer.size());
-      if (!res3) {
-         co_return;
+      if (output.pending() >= max_queued_output) {
+         const auto res3 = co_await output.drain();
+         if (!res3) {
+            co_return;
+         }
       }
    }
 }
 
-socket_task server_accept_loop(int socket_handle, std::vector<socket_task>& tasks)
+// Per-thread scheduler settings, the same for every thread
+struct thread_options {
+   // Operations a connection can complete in one go before letting the others run, 0 for no limit
+   unsigned yield_limit = yield_budget::default_limit;
+   // How long the scheduler spins before blocking, 0 to block straight away
+   std::chrono::microseconds busy_poll{0};
+   // SO_BUSY_POLL for accepted sockets: how long a read on an empty socket has the kernel poll the device queue
+   int socket_busy_poll_us = 0;
+};
+
+// Has the kernel busy poll the device queue when the connection's socket has nothing to read. Needs CAP_NET_ADMIN
+// to raise it above net.core.busy_read, which is reported once rather than for every connection.
+void set_socket_busy_poll(int sock_handle, int usecs)
+{
+   static std::atomic_flag reported;
+   if (setsockopt(sock_handle, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0 && !reported.test_and_set()) {
+      std::cerr << "Setting SO_BUSY_POLL failed with " << errno << '\n';
+   }
+}
+
+socket_task server_accept_loop(
+   listener& listen, connection_limit& limit, const thread_options& options, std::vector<socket_task>& tasks)
 {
+   std::array<int, max_accept_batch> accepted;
+   auto& stats = listen.stats;
    while (true) {
-      const auto result = co_await async_accept(socket_handle);
+      auto claimed = limit.claim(accepted.size());
+      if (claimed == 0) {
+         stats.pauses += 1;
+         do {
+            // Nothing wakes us when a connection closes on another thread, so check back every millisecond
+            co_await async_sleep(std::chrono::milliseconds{1});
+            claimed = limit.claim(accepted.size());
+         } while (claimed == 0);
+      }
+      const auto result = co_await async_accept(listen.socket, std::span{accepted}.first(claimed));
+      limit.settle(claimed, result.value_or(0));
       if (!result) {
+         stats.errors += 1;
          std::cerr << "Accepting errored with " << result.error() << "\n";
+         if (result.error() == EMFILE || result.error() == ENFILE) {
+            // Out of fds, the connection stays queued so retrying straight away would spin
+            co_await async_sleep(std::chrono::milliseconds{10});
+         }
+         continue;
       }
-      else {
-         tasks.push_back(server_task(result.value()));
+      const auto num_accepted = result.value();
+      stats.accepted += num_accepted;
+      stats.batches += 1;
+      if (num_accepted > stats.largest_batch) {
+         stats.largest_batch = num_accepted;
+      }
+      for (std::size_t i = 0; i < num_accepted; ++i) {
+         if (options.socket_busy_poll_us > 0) {
+            set_socket_busy_poll(accepted[i], options.socket_busy_poll_us);
+         }
+         tasks.push_back(server_task(accepted[i], limit));
       }
    }
 }
 
-int main(int argc, const char* argv[])
+// Returns -1 on failure after printing why
+int make_listen_socket(int port_no, bool reuse_port, int backlog)
 {
-   std::signal(SIGPIPE, SIG_IGN);
-   if (argc != 2) {
-      std::cerr << "Usage:\n" << argv[0] << " port_number\n";
-      return 2;
-   }
-   const auto port_no = std::atoi(argv[1]);
-   if (port_no <= 0) {
-      std::cerr << "Error parsing port number\n";
-      return 2;
-   }
-
-   constexpr int max_listen_queue = 50;
    const int listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
    if (listen_socket < 0) {
       std::cerr << "Creating socket failed\n";
-      return 1;
+      return -1;
    }
    // set no delay
    int enable = 1;
    setsockopt(listen_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+   // Each thread binds its own socket to the same port and the kernel spreads incoming connections across them
+   if (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+      std::cerr << "Setting SO_REUSEPORT failed\n";
+      close(listen_socket);
+      return -1;
+   }
 
    sockaddr_in addr;
    std::memset(&addr, 0, sizeof(addr));
@@ -75,16 +228,284 @@ int main(int argc, const char* argv[])
    const auto bind_res = bind(listen_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
    if (bind_res < 0) {
       std::cerr << "Binding socket failed\n";
-      return 1;
+      close(listen_socket);
+      return -1;
    }
 
-   const auto listen_res = listen(listen_socket, max_listen_queue);
+   // The kernel caps this at net.core.somaxconn
+   const auto listen_res = listen(listen_socket, backlog);
    if (listen_res < 0) {
       std::cerr << "Listen socket failed\n";
-      return 1;
+      close(listen_socket);
+      return -1;
    }
+   return listen_socket;
+}
 
+// Every thread owns its listening socket, task list and scheduler, nothing is shared between them
+void run_server_thread(listener& listen, connection_limit& limit, const thread_options& options)
+{
+   yield_budget::this_thread().set_limit(options.yield_limit);
+   busy_poll_budget::this_thread() = options.busy_poll;
    std::vector<socket_task> tasks;
-   tasks.push_back(server_accept_loop(listen_socket, tasks));
+   tasks.push_back(server_accept_loop(listen, limit, options, tasks));
    socket_scheduler(tasks);
 }
+
+void print_histogram(std::ostream& out, const histogram& values, double scale)
+{
+   out << " mean " << values.mean() / scale << " p50 " << static_cast<double>(values.percentile(50)) / scale
+       << " p99 " << static_cast<double>(values.percentile(99)) / scale << " p99.9 "
+       << static_cast<double>(values.percentile(99.9)) / scale << " max " << static_cast<double>(values.max()) / scale
+       << '\n';
+}
+
+void print_scheduler_stats(std::ostream& out)
+{
+   for (const auto& stats : scheduler_stats::snapshot()) {
+      const auto prefix = "thread " + std::to_string(stats.thread_index);
+      out << prefix << " polls " << stats.polls << " empty_polls " << stats.empty_polls << " resumes "
+          << stats.resumes << " slowest_resume_us " << static_cast<double>(stats.slowest_resume_ns) / 1000.0
+          << " slowest_resume_fd " << stats.slowest_resume_fd << '\n';
+      out << prefix << " busy_polls " << stats.busy_polls << " busy_poll_hits " << stats.busy_poll_hits << " spin_ms "
+          << static_cast<double>(stats.spin_ns) / 1e6 << " sleeps " << stats.sleeps << '\n';
+      out << prefix << " tasks_per_poll";
+      print_histogram(out, stats.tasks_per_poll, 1.0);
+      out << prefix << " ready_per_poll";
+      print_histogram(out, stats.ready_per_poll, 1.0);
+      out << prefix << " resume_us";
+      print_histogram(out, stats.resume_ns, 1000.0);
+      out << prefix << " ready_wait_us";
+      print_histogram(out, stats.ready_wait_ns, 1000.0);
+   }
+   for (const auto& pool : buffer_pool::snapshot()) {
+      out << "buffer_pool " << pool.thread_index << " buffers_in_use " << pool.in_use << " buffers_high_water "
+          << pool.high_water << " slabs " << pool.slabs << " slab_kib "
+          << pool.slabs * buffer_pool::buffers_per_slab * buffer_pool::buffer_size / 1024 << '\n';
+   }
+   out.flush();
+}
+
+// The kernel's counts of connections dropped because an accept queue was full (ListenOverflows) and dropped while
+// listening for any reason (ListenDrops). They cover every listening socket on the machine, not just ours.
+std::optional<std::pair<std::uint64_t, std::uint64_t>> read_listen_drops()
+{
+   std::ifstream netstat{"/proc/net/netstat"};
+   std::string names;
+   std::string values;
+   // Each group of counters is a line of names followed by a line of values
+   while (std::getline(netstat, names) && std::getline(netstat, values)) {
+      if (!names.starts_with("TcpExt:")) {
+         continue;
+      }
+      std::istringstream name_words{names};
+      std::istringstream value_words{values};
+      std::string name;
+      std::string value;
+      std::optional<std::uint64_t> overflows;
+      std::optional<std::uint64_t> drops;
+      while (name_words >> name && value_words >> value) {
+         if (name == "ListenOverflows") {
+            overflows = std::stoull(value);
+         }
+         else if (name == "ListenDrops") {
+            drops = std::stoull(value);
+         }
+      }
+      if (overflows && drops) {
+         return std::pair{*overflows, *drops};
+      }
+   }
+   return std::nullopt;
+}
+
+// Accept counts per listener, with the accept rate since the last call taken from last_accepted
+void print_accept_stats(
+   std::ostream& out, const std::vector<listener>& listeners, const connection_limit& limit,
+   std::vector<std::uint64_t>& last_accepted, std::chrono::steady_clock::duration since_last)
+{
+   last_accepted.resize(listeners.size());
+   const auto seconds = std::chrono::duration<double>{since_last}.count();
+   for (std::size_t i = 0; i < listeners.size(); ++i) {
+      const auto& stats = listeners[i].stats;
+      const std::uint64_t accepted = stats.accepted;
+      out << "listener " << i << " accepted " << accepted << " accepted_per_s "
+          << (seconds > 0 ? static_cast<double>(accepted - last_accepted[i]) / seconds : 0.0) << " accept_batches "
+          << stats.batches << " largest_accept_batch " << stats.largest_batch << " accept_errors " << stats.errors
+          << " accept_pauses " << stats.pauses;
+      last_accepted[i] = accepted;
+      // For a listening socket these are the accept queue's length and its limit
+      tcp_info info;
+      socklen_t info_size = sizeof(info);
+      if (getsockopt(listeners[i].socket, IPPROTO_TCP, TCP_INFO, &info, &info_size) == 0) {
+         out << " accept_queue " << info.tcpi_unacked << " backlog " << info.tcpi_sacked;
+      }
+      out << '\n';
+   }
+   out << "connections_open " << limit.open() << " max_connections " << limit.max() << '\n';
+   if (const auto drops = read_listen_drops()) {
+      out << "listen_overflows " << drops->first << " listen_drops " << drops->second << '\n';
+   }
+   out.flush();
+}
+
+// Prints the scheduler and accept stats whenever the process gets SIGUSR1, and every interval if it isn't zero.
+// SIGUSR1 must already be blocked in every thread.
+void run_stats_thread(
+   std::chrono::seconds interval, const std::vector<listener>& listeners, const connection_limit& limit)
+{
+   std::vector<std::uint64_t> last_accepted;
+   auto last_time = std::chrono::steady_clock::now();
+   sigset_t signals;
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGUSR1);
+   const timespec timeout{static_cast<time_t>(interval.count()), 0};
+   while (true) {
+      const auto res
+         = interval.count() > 0 ? sigtimedwait(&signals, nullptr, &timeout) : sigwaitinfo(&signals, nullptr);
+      if (res < 0 && errno != EAGAIN) {
+         continue;
+      }
+      print_scheduler_stats(std::cout);
+      const auto now = std::chrono::steady_clock::now();
+      print_accept_stats(std::cout, listeners, limit, last_accepted, now - last_time);
+      last_time = now;
+   }
+}
+
+void pin_to_cpu(std::thread& thread, unsigned cpu)
+{
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu, &cpus);
+   const auto res = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+   if (res != 0) {
+      std::cerr << "Pinning thread to CPU " << cpu << " failed with " << res << '\n';
+   }
+}
+
+int main(int argc, const char* argv[])
+{
+   std::signal(SIGPIPE, SIG_IGN);
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " port_number [--threads num_threads] [--pin] [--stats-interval seconds] [--backlog n]"
+                   " [--max-connections n] [--yield-budget operations] [--busy-poll usecs]"
+                   " [--so-busy-poll usecs]\n";
+      return 2;
+   };
+   if (argc < 2) {
+      return usage();
+   }
+   const auto port_no = std::atoi(argv[1]);
+   if (port_no <= 0) {
+      std::cerr << "Error parsing port number\n";
+      return 2;
+   }
+
+   int num_threads = 1;
+   bool pin_threads = false;
+   std::chrono::seconds stats_interval{0};
+   int backlog = SOMAXCONN;
+   int max_connections = 0;
+   thread_options options;
+   for (int i = 2; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (arg == "--threads" && i + 1 < argc) {
+         i += 1;
+         num_threads = std::atoi(argv[i]);
+         if (num_threads <= 0) {
+            std::cerr << "Error parsing number of threads\n";
+            return 2;
+         }
+      }
+      else if (arg == "--pin") {
+         pin_threads = true;
+      }
+      else if (arg == "--stats-interval" && i + 1 < argc) {
+         i += 1;
+         stats_interval = std::chrono::seconds{std::atoi(argv[i])};
+         if (stats_interval.count() <= 0) {
+            std::cerr << "Error parsing stats interval\n";
+            return 2;
+         }
+      }
+      else if (arg == "--backlog" && i + 1 < argc) {
+         i += 1;
+         backlog = std::atoi(argv[i]);
+         if (backlog <= 0) {
+            std::cerr << "Error parsing backlog\n";
+            return 2;
+         }
+      }
+      else if (arg == "--max-connections" && i + 1 < argc) {
+         i += 1;
+         max_connections = std::atoi(argv[i]);
+         if (max_connections <= 0) {
+            std::cerr << "Error parsing max connections\n";
+            return 2;
+         }
+      }
+      else if (arg == "--yield-budget" && i + 1 < argc) {
+         i += 1;
+         const auto limit = std::atoi(argv[i]);
+         if (limit < 0) {
+            std::cerr << "Error parsing yield budget\n";
+            return 2;
+         }
+         options.yield_limit = static_cast<unsigned>(limit);
+      }
+      else if ((arg == "--busy-poll" || arg == "--so-busy-poll") && i + 1 < argc) {
+         i += 1;
+         const auto usecs = std::atoi(argv[i]);
+         if (usecs < 0) {
+            std::cerr << "Error parsing " << arg << '\n';
+            return 2;
+         }
+         if (arg == "--busy-poll") {
+            options.busy_poll = std::chrono::microseconds{usecs};
+         }
+         else {
+            options.socket_busy_poll_us = usecs;
+         }
+      }
+      else {
+         return usage();
+      }
+   }
+
+   // Create every listening socket up front so a failure is reported before any thread starts serving
+   std::vector<listener> listeners(num_threads);
+   for (auto& listen : listeners) {
+      listen.socket = make_listen_socket(port_no, num_threads > 1, backlog);
+      if (listen.socket < 0) {
+         return 1;
+      }
+   }
+   connection_limit limit{max_connections};
+
+   // Block SIGUSR1 before starting any thread so only the stats thread ever takes it
+   sigset_t stats_signals;
+   sigemptyset(&stats_signals);
+   sigaddset(&stats_signals, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &stats_signals, nullptr);
+   std::thread{run_stats_thread, stats_interval, std::cref(listeners), std::cref(limit)}.detach();
+
+   if (num_threads == 1 && !pin_threads) {
+      run_server_thread(listeners.front(), limit, options);
+      return 0;
+   }
+
+   const auto num_cpus = std::max(1u, std::thread::hardware_concurrency());
+   std::vector<std::thread> threads;
+   for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back(run_server_thread, std::ref(listeners[i]), std::ref(limit), std::cref(options));
+      if (pin_threads) {
+         pin_to_cpu(threads.back(), i % num_cpus);
+      }
+   }
+   for (auto& thread : threads) {
+      thread.join();
+   }
+}
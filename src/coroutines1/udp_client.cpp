@@ -0,0 +1,200 @@
+#include "lib.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Load generator for the UDP echo server. Each socket sends a batch of datagrams with one sendmmsg, then collects
+// the echoes with recvmmsg until it has them all or it gives up on the rest, and starts the next batch. UDP can
+// drop datagrams, so what's reported is the rate of datagrams echoed back and how many were lost.
+
+using clock_type = std::chrono::steady_clock;
+
+// How long to wait for the rest of a batch's echoes before counting them as lost
+constexpr auto echo_timeout = std::chrono::milliseconds{20};
+
+struct load_options {
+   const char* host = "localhost";
+   std::size_t batch_size = 64;
+   // Bytes per datagram
+   std::size_t datagram_size = 64;
+   clock_type::duration warmup = std::chrono::seconds{1};
+   clock_type::duration duration = std::chrono::seconds{10};
+};
+
+// Counts of datagrams in batches started after the warmup
+struct load_results {
+   std::uint64_t sent = 0;
+   std::uint64_t received = 0;
+   std::uint64_t batches = 0;
+   std::uint64_t timeouts = 0;
+   std::uint64_t failed_sockets = 0;
+};
+
+socket_task client_loop(
+   const char* port_no, const load_options& options, clock_type::time_point start, load_results& results)
+{
+   const auto addresses = co_await async_resolve(options.host, port_no);
+   if (!addresses || (*addresses)->empty()) {
+      std::cerr << "Lookup failed: " << gai_strerror(addresses ? EAI_NONAME : addresses.error()) << '\n';
+      results.failed_sockets += 1;
+      co_return;
+   }
+   const auto& address = (*addresses)->front();
+   const int sock = socket(address.addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+   if (sock < 0 || connect(sock, reinterpret_cast<const sockaddr*>(&address.addr), address.len) < 0) {
+      std::cerr << "Connect failed: " << std::strerror(errno) << '\n';
+      if (sock >= 0) {
+         close(sock);
+      }
+      results.failed_sockets += 1;
+      co_return;
+   }
+
+   // Sent and received from separate buffers so the payloads sent stay as they are
+   datagram_batch to_send{options.batch_size, options.datagram_size};
+   datagram_batch to_receive{options.batch_size, options.datagram_size};
+   for (std::size_t i = 0; i < to_send.size(); ++i) {
+      std::memset(to_send.buffer(i).data(), static_cast<int>(i), options.datagram_size);
+      to_send.set_length(i, options.datagram_size);
+   }
+
+   const auto measure_from = start + options.warmup;
+   const auto stop_at = measure_from + options.duration;
+   while (true) {
+      const auto batch_start = clock_type::now();
+      if (batch_start >= stop_at) {
+         co_return;
+      }
+      const bool measured = batch_start >= measure_from;
+
+      const auto res1 = co_await async_send_batch(sock, to_send.headers());
+      if (!res1) {
+         std::cerr << "Send failed: " << std::strerror(res1.error()) << '\n';
+         co_return;
+      }
+      const auto num_sent = res1.value();
+
+      std::size_t num_received = 0;
+      while (num_received < num_sent) {
+         const auto wanted = to_receive.prepare_recv().first(num_sent - num_received);
+         const auto res2 = co_await with_timeout(async_recv_batch(sock, wanted), echo_timeout);
+         if (!res2) {
+            // Echoes that turn up after this count towards the next batch, which keeps the totals right
+            if (res2.error() != ETIMEDOUT) {
+               std::cerr << "Receive failed: " << std::strerror(res2.error()) << '\n';
+               co_return;
+            }
+            if (measured) {
+               results.timeouts += 1;
+            }
+            break;
+         }
+         num_received += res2.value();
+      }
+
+      if (measured) {
+         results.sent += num_sent;
+         results.received += num_received;
+         results.batches += 1;
+      }
+   }
+}
+
+void print_results(const load_results& results, const load_options& options, int num_sockets)
+{
+   const auto seconds = std::chrono::duration<double>{options.duration}.count();
+   std::cout << "sockets " << num_sockets << '\n';
+   std::cout << "failed_sockets " << results.failed_sockets << '\n';
+   std::cout << "batch_size " << options.batch_size << '\n';
+   std::cout << "datagram_size " << options.datagram_size << '\n';
+   std::cout << "duration_s " << seconds << '\n';
+   std::cout << "sent " << results.sent << '\n';
+   std::cout << "received " << results.received << '\n';
+   std::cout << "lost " << (results.sent > results.received ? results.sent - results.received : 0) << '\n';
+   std::cout << "batches " << results.batches << '\n';
+   std::cout << "timeouts " << results.timeouts << '\n';
+   std::cout << "sent_pps " << static_cast<double>(results.sent) / seconds << '\n';
+   std::cout << "received_pps " << static_cast<double>(results.received) / seconds << '\n';
+}
+
+int main(int argc, const char* argv[])
+{
+   std::signal(SIGPIPE, SIG_IGN);
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " port_number num_sockets [--host name] [--batch datagrams] [--size bytes] [--warmup seconds]"
+                   " [--duration seconds]\n";
+      return 2;
+   };
+   if (argc < 3) {
+      return usage();
+   }
+
+   const auto port_no_test = std::atoi(argv[1]);
+   if (port_no_test <= 0) {
+      std::cerr << "Error converting port number\n";
+      return 2;
+   }
+
+   const auto num_sockets = std::atoi(argv[2]);
+   if (num_sockets <= 0) {
+      std::cerr << "Error converting number of sockets\n";
+      return 2;
+   }
+
+   load_options options;
+   for (int i = 3; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (i + 1 == argc) {
+         return usage();
+      }
+      i += 1;
+      if (arg == "--host") {
+         options.host = argv[i];
+      }
+      else if (arg == "--batch") {
+         const auto batch_size = std::atoi(argv[i]);
+         if (batch_size <= 0 || batch_size > UIO_MAXIOV) {
+            std::cerr << "Error parsing batch size, it must be from 1 to " << UIO_MAXIOV << '\n';
+            return 2;
+         }
+         options.batch_size = static_cast<std::size_t>(batch_size);
+      }
+      else if (arg == "--size") {
+         // The server truncates anything over 2048 bytes
+         const auto size = std::atoi(argv[i]);
+         if (size <= 0 || size > 2048) {
+            std::cerr << "Error parsing datagram size, it must be from 1 to 2048\n";
+            return 2;
+         }
+         options.datagram_size = static_cast<std::size_t>(size);
+      }
+      else if (arg == "--warmup" || arg == "--duration") {
+         const auto seconds = std::atof(argv[i]);
+         if (seconds < 0 || (arg == "--duration" && seconds == 0)) {
+            std::cerr << "Error parsing " << arg << '\n';
+            return 2;
+         }
+         (arg == "--warmup" ? options.warmup : options.duration)
+            = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>{seconds});
+      }
+      else {
+         return usage();
+      }
+   }
+
+   load_results results;
+   const auto start = clock_type::now();
+   std::vector<socket_task> tasks;
+   for (int i = 0; i < num_sockets; ++i) {
+      tasks.emplace_back(client_loop(argv[1], options, start, results));
+   }
+   socket_scheduler(tasks);
+   print_results(results, options, num_sockets);
+}
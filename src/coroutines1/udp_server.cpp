@@ -0,0 +1,220 @@
+#include "lib.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// UDP echo server. Each thread has its own socket bound to the port (with SO_REUSEPORT when there are several, so
+// the kernel spreads datagrams across them), receives datagrams in batches with recvmmsg and sends each batch
+// back to where it came from with a single sendmmsg. Prints each socket's packet rates every stats interval and
+// whenever it gets SIGUSR1.
+
+// Anything bigger is truncated
+constexpr std::size_t max_datagram_size = 2048;
+
+// What a thread's socket has done
+struct echo_stats {
+   single_writer_counter received;
+   single_writer_counter sent;
+   single_writer_counter batches;
+   single_writer_counter largest_batch;
+   single_writer_counter errors;
+};
+
+struct echo_socket {
+   int socket = -1;
+   echo_stats stats;
+};
+
+socket_task echo_loop(echo_socket& sock, std::size_t batch_size)
+{
+   datagram_batch batch{batch_size, max_datagram_size};
+   auto& stats = sock.stats;
+   while (true) {
+      const auto res1 = co_await async_recv_batch(sock.socket, batch.prepare_recv());
+      if (!res1) {
+         // Nothing that goes wrong with one datagram stops the others being received
+         stats.errors += 1;
+         continue;
+      }
+      const auto num_received = res1.value();
+      stats.received += num_received;
+      stats.batches += 1;
+      if (num_received > stats.largest_batch) {
+         stats.largest_batch = num_received;
+      }
+
+      // Every datagram goes back to the address it was received from
+      for (std::size_t i = 0; i < num_received; ++i) {
+         batch.set_length(i, std::min(batch.received(i), max_datagram_size));
+      }
+      const auto res2 = co_await async_send_batch(sock.socket, batch.headers().first(num_received));
+      if (!res2 || res2.value() < num_received) {
+         stats.errors += 1;
+      }
+      stats.sent += res2.value_or(0);
+   }
+}
+
+// Returns -1 on failure after printing why
+int make_udp_socket(int port_no, bool reuse_port)
+{
+   const int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+   if (sock < 0) {
+      std::cerr << "Creating socket failed\n";
+      return -1;
+   }
+   int enable = 1;
+   if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+      std::cerr << "Setting SO_REUSEPORT failed\n";
+      close(sock);
+      return -1;
+   }
+
+   sockaddr_in addr;
+   std::memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_port = htons(port_no);
+   if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+      std::cerr << "Binding socket failed\n";
+      close(sock);
+      return -1;
+   }
+   return sock;
+}
+
+void run_echo_thread(echo_socket& sock, std::size_t batch_size)
+{
+   std::vector<socket_task> tasks;
+   tasks.push_back(echo_loop(sock, batch_size));
+   socket_scheduler(tasks);
+}
+
+// Prints the packet counts per socket, with the rates since the last call taken from last_received and last_sent
+void print_echo_stats(
+   std::ostream& out, const std::vector<echo_socket>& sockets, std::vector<std::uint64_t>& last_received,
+   std::vector<std::uint64_t>& last_sent, std::chrono::steady_clock::duration since_last)
+{
+   last_received.resize(sockets.size());
+   last_sent.resize(sockets.size());
+   const auto seconds = std::chrono::duration<double>{since_last}.count();
+   const auto per_second = [seconds](std::uint64_t count, std::uint64_t last) {
+      return seconds > 0 ? static_cast<double>(count - last) / seconds : 0.0;
+   };
+   for (std::size_t i = 0; i < sockets.size(); ++i) {
+      const auto& stats = sockets[i].stats;
+      const std::uint64_t received = stats.received;
+      const std::uint64_t sent = stats.sent;
+      const std::uint64_t batches = stats.batches;
+      out << "socket " << i << " received " << received << " received_pps " << per_second(received, last_received[i])
+          << " sent " << sent << " sent_pps " << per_second(sent, last_sent[i]) << " batches " << batches
+          << " mean_batch " << (batches > 0 ? static_cast<double>(received) / static_cast<double>(batches) : 0.0)
+          << " largest_batch " << stats.largest_batch << " errors " << stats.errors << '\n';
+      last_received[i] = received;
+      last_sent[i] = sent;
+   }
+   out.flush();
+}
+
+// SIGUSR1 must already be blocked in every thread
+void run_stats_thread(std::chrono::seconds interval, const std::vector<echo_socket>& sockets)
+{
+   std::vector<std::uint64_t> last_received;
+   std::vector<std::uint64_t> last_sent;
+   auto last_time = std::chrono::steady_clock::now();
+   sigset_t signals;
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGUSR1);
+   const timespec timeout{static_cast<time_t>(interval.count()), 0};
+   while (true) {
+      const auto res
+         = interval.count() > 0 ? sigtimedwait(&signals, nullptr, &timeout) : sigwaitinfo(&signals, nullptr);
+      if (res < 0 && errno != EAGAIN) {
+         continue;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      print_echo_stats(std::cout, sockets, last_received, last_sent, now - last_time);
+      last_time = now;
+   }
+}
+
+int main(int argc, const char* argv[])
+{
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0] << " port_number [--threads num_threads] [--batch datagrams] [--stats-interval seconds]\n";
+      return 2;
+   };
+   if (argc < 2) {
+      return usage();
+   }
+   const auto port_no = std::atoi(argv[1]);
+   if (port_no <= 0) {
+      std::cerr << "Error parsing port number\n";
+      return 2;
+   }
+
+   int num_threads = 1;
+   int batch_size = 64;
+   std::chrono::seconds stats_interval{0};
+   for (int i = 2; i < argc; ++i) {
+      const std::string_view arg = argv[i];
+      if (i + 1 == argc) {
+         return usage();
+      }
+      i += 1;
+      if (arg == "--threads") {
+         num_threads = std::atoi(argv[i]);
+         if (num_threads <= 0) {
+            std::cerr << "Error parsing number of threads\n";
+            return 2;
+         }
+      }
+      else if (arg == "--batch") {
+         // recvmmsg and sendmmsg take at most UIO_MAXIOV datagrams
+         batch_size = std::atoi(argv[i]);
+         if (batch_size <= 0 || batch_size > UIO_MAXIOV) {
+            std::cerr << "Error parsing batch size, it must be from 1 to " << UIO_MAXIOV << '\n';
+            return 2;
+         }
+      }
+      else if (arg == "--stats-interval") {
+         stats_interval = std::chrono::seconds{std::atoi(argv[i])};
+         if (stats_interval.count() <= 0) {
+            std::cerr << "Error parsing stats interval\n";
+            return 2;
+         }
+      }
+      else {
+         return usage();
+      }
+   }
+
+   std::vector<echo_socket> sockets(num_threads);
+   for (auto& sock : sockets) {
+      sock.socket = make_udp_socket(port_no, num_threads > 1);
+      if (sock.socket < 0) {
+         return 1;
+      }
+   }
+
+   // Block SIGUSR1 before starting any thread so only the stats thread ever takes it
+   sigset_t stats_signals;
+   sigemptyset(&stats_signals);
+   sigaddset(&stats_signals, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &stats_signals, nullptr);
+   std::thread{run_stats_thread, stats_interval, std::cref(sockets)}.detach();
+
+   std::vector<std::thread> threads;
+   for (int i = 1; i < num_threads; ++i) {
+      threads.emplace_back(run_echo_thread, std::ref(sockets[i]), static_cast<std::size_t>(batch_size));
+   }
+   run_echo_thread(sockets.front(), static_cast<std::size_t>(batch_size));
+   for (auto& thread : threads) {
+      thread.join();
+   }
+}
@@ -0,0 +1,151 @@
+#include "lib.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Compares work_stealing_scheduler against statically partitioning connections across threads that each run
+// socket_scheduler. Each connection is a socketpair with a task on either end: one sends requests and the other
+// does an amount of CPU work per request that depends on the connection, with a few connections doing most of
+// the work as happens with real traffic.
+
+// Does roughly work_units * 100 dependent multiplies
+std::uint64_t burn(std::uint64_t value, int work_units) noexcept
+{
+   for (int i = 0; i < work_units * 100; ++i) {
+      value ^= value << 13;
+      value ^= value >> 7;
+      value ^= value << 17;
+      value *= 0x9E3779B97F4A7C15;
+   }
+   return value;
+}
+
+socket_task responder(int sock_handle, int work_units)
+{
+   while (true) {
+      // 8 byte messages over a unix socketpair are never split
+      std::uint64_t request;
+      const auto res1 = co_await async_read(sock_handle, reinterpret_cast<char*>(&request), sizeof(request));
+      if (!res1 || res1.value() == 0) {
+         co_return;
+      }
+      const auto reply = burn(request, work_units);
+      const auto res2 = co_await async_write(sock_handle, reinterpret_cast<const char*>(&reply), sizeof(reply));
+      if (!res2) {
+         co_return;
+      }
+   }
+}
+
+socket_task requester(int sock_handle, int rounds)
+{
+   std::uint64_t value = sock_handle;
+   for (int i = 0; i < rounds; ++i) {
+      const auto res1 = co_await async_write(sock_handle, reinterpret_cast<const char*>(&value), sizeof(value));
+      if (!res1) {
+         std::cerr << "Write failed\n";
+         co_return;
+      }
+      const auto res2 = co_await async_read(sock_handle, reinterpret_cast<char*>(&value), sizeof(value));
+      if (!res2 || res2.value() == 0) {
+         std::cerr << "Read failed\n";
+         co_return;
+      }
+   }
+   // Destroying this task closes the socket, which ends the responder
+}
+
+// Zipf-like: the first connection does the most work, connection i does 1/(i+1) of that
+int work_units_for(int connection) noexcept { return std::max(1, 1000 / (connection + 1)); }
+
+// Fills tasks_per_thread[i % num_threads] with both ends of connection i
+bool make_connections(std::vector<std::vector<socket_task>>& tasks_per_thread, int num_connections, int rounds)
+{
+   const auto num_threads = tasks_per_thread.size();
+   for (int i = 0; i < num_connections; ++i) {
+      int socks[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, socks) < 0) {
+         std::cerr << "socketpair failed\n";
+         return false;
+      }
+      auto& tasks = tasks_per_thread[i % num_threads];
+      tasks.push_back(responder(socks[0], work_units_for(i)));
+      tasks.push_back(requester(socks[1], rounds));
+   }
+   return true;
+}
+
+double time_static_partitioning(unsigned num_threads, int num_connections, int rounds)
+{
+   std::vector<std::vector<socket_task>> tasks_per_thread(num_threads);
+   if (!make_connections(tasks_per_thread, num_connections, rounds)) {
+      std::exit(1);
+   }
+   const auto start_time = std::chrono::steady_clock::now();
+   std::vector<std::thread> threads;
+   for (auto& tasks : tasks_per_thread) {
+      threads.emplace_back([&tasks]() { socket_scheduler(tasks); });
+   }
+   for (auto& thread : threads) {
+      thread.join();
+   }
+   return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+double time_work_stealing(unsigned num_threads, int num_connections, int rounds)
+{
+   // Give the work stealing scheduler the same starting partition (exactly the same when num_connections is a
+   // multiple of num_threads); it assigns task i to worker i % num_threads
+   std::vector<std::vector<socket_task>> tasks_per_thread(num_threads);
+   if (!make_connections(tasks_per_thread, num_connections, rounds)) {
+      std::exit(1);
+   }
+   std::vector<socket_task> tasks;
+   for (std::size_t i = 0;; ++i) {
+      bool any_left = false;
+      for (auto& thread_tasks : tasks_per_thread) {
+         if (i < thread_tasks.size()) {
+            any_left = true;
+            tasks.push_back(std::move(thread_tasks[i]));
+         }
+      }
+      if (!any_left) {
+         break;
+      }
+   }
+   const auto start_time = std::chrono::steady_clock::now();
+   work_stealing_scheduler{tasks, num_threads}.run();
+   return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+int main(int argc, const char* argv[])
+{
+   std::signal(SIGPIPE, SIG_IGN);
+   if (argc > 4) {
+      std::cerr << "Usage:\n" << argv[0] << " [num_threads [num_connections [rounds]]]\n";
+      return 2;
+   }
+   const auto num_threads = argc > 1 ? std::atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+   const auto num_connections = argc > 2 ? std::atoi(argv[2]) : 64;
+   const auto rounds = argc > 3 ? std::atoi(argv[3]) : 1000;
+   if (num_threads <= 0 || num_connections <= 0 || rounds <= 0) {
+      std::cerr << "Arguments must be positive integers\n";
+      return 2;
+   }
+
+   const auto static_ms = time_static_partitioning(num_threads, num_connections, rounds);
+   const auto stealing_ms = time_work_stealing(num_threads, num_connections, rounds);
+   std::cout << "threads " << num_threads << '\n';
+   std::cout << "connections " << num_connections << '\n';
+   std::cout << "rounds " << rounds << '\n';
+   std::cout << "static_partitioning_ms " << static_ms << '\n';
+   std::cout << "work_stealing_ms " << stealing_ms << '\n';
+   std::cout << "speedup " << static_ms / stealing_ms << '\n';
+   for (const auto& entry : frame_stats::snapshot()) {
+      std::cout << "frame_size " << entry.frame_size << " allocations " << entry.allocations << ' ' << entry.function
+                << '\n';
+   }
+}
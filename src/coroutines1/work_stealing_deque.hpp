@@ -0,0 +1,129 @@
+#ifndef WORK_STEALING_DEQUE_HPP
+#define WORK_STEALING_DEQUE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// Chase-Lev work-stealing deque (using the memory orderings from "Correct and Efficient Work-Stealing for Weak
+// Memory Models", Lê et al. 2013). The owning thread pushes and pops at the bottom, any other thread may steal
+// from the top. Pushing an item happens-before stealing or popping it, so it can be used to hand coroutine
+// handles between threads.
+template<typename T>
+   requires std::is_trivially_copyable_v<T>
+class work_stealing_deque {
+public:
+   explicit work_stealing_deque(std::size_t initial_capacity = 256)
+   {
+      std::size_t capacity = 1;
+      while (capacity < initial_capacity) {
+         capacity *= 2;
+      }
+      rings_.push_back(std::make_unique<ring>(capacity));
+      ring_.store(rings_.back().get(), std::memory_order_relaxed);
+   }
+
+   work_stealing_deque(const work_stealing_deque&) = delete;
+   work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+   // Owner only
+   void push(T item)
+   {
+      const auto bottom = bottom_.load(std::memory_order_relaxed);
+      const auto top = top_.load(std::memory_order_acquire);
+      auto* r = ring_.load(std::memory_order_relaxed);
+      if (bottom - top > static_cast<std::int64_t>(r->capacity) - 1) {
+         r = grow(r, bottom, top);
+      }
+      r->put(bottom, item);
+      std::atomic_thread_fence(std::memory_order_release);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+   }
+
+   // Owner only, takes the most recently pushed item
+   std::optional<T> pop()
+   {
+      const auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+      auto* const r = ring_.load(std::memory_order_relaxed);
+      bottom_.store(bottom, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto top = top_.load(std::memory_order_relaxed);
+      if (top > bottom) {
+         // Empty
+         bottom_.store(bottom + 1, std::memory_order_relaxed);
+         return std::nullopt;
+      }
+      const auto item = r->get(bottom);
+      if (top == bottom) {
+         // Last item, race any thieves for it
+         const bool won
+            = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+         bottom_.store(bottom + 1, std::memory_order_relaxed);
+         if (!won) {
+            return std::nullopt;
+         }
+      }
+      return item;
+   }
+
+   // Any thread, takes the least recently pushed item. Can fail spuriously if it loses a race with another thief.
+   std::optional<T> steal()
+   {
+      auto top = top_.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const auto bottom = bottom_.load(std::memory_order_acquire);
+      if (top >= bottom) {
+         return std::nullopt;
+      }
+      const auto item = ring_.load(std::memory_order_acquire)->get(top);
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+         return std::nullopt;
+      }
+      return item;
+   }
+
+   // Only a hint when called by a thread other than the owner
+   bool empty() const noexcept
+   {
+      return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+   }
+
+private:
+   struct ring {
+      explicit ring(std::size_t capacity) : capacity{capacity}, items{std::make_unique<std::atomic<T>[]>(capacity)}
+      {}
+
+      T get(std::int64_t index) const noexcept
+      { return items[static_cast<std::size_t>(index) & (capacity - 1)].load(std::memory_order_relaxed); }
+
+      void put(std::int64_t index, T item) noexcept
+      { items[static_cast<std::size_t>(index) & (capacity - 1)].store(item, std::memory_order_relaxed); }
+
+      std::size_t capacity;
+      std::unique_ptr<std::atomic<T>[]> items;
+   };
+
+   ring* grow(ring* old, std::int64_t bottom, std::int64_t top)
+   {
+      auto bigger = std::make_unique<ring>(old->capacity * 2);
+      for (auto i = top; i < bottom; ++i) {
+         bigger->put(i, old->get(i));
+      }
+      // Thieves may still be reading the old ring, so every ring is kept until the deque is destroyed. Each one
+      // is twice the size of the last so this at most doubles the memory used.
+      rings_.push_back(std::move(bigger));
+      ring_.store(rings_.back().get(), std::memory_order_release);
+      return rings_.back().get();
+   }
+
+   alignas(64) std::atomic<std::int64_t> top_{0};
+   alignas(64) std::atomic<std::int64_t> bottom_{0};
+   std::atomic<ring*> ring_;
+   // Owner only
+   std::vector<std::unique_ptr<ring>> rings_;
+};
+
+#endif // WORK_STEALING_DEQUE_HPP
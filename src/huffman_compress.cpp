@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Compresses a file with the code mapping huffman_encoding writes as JSON. The codes are packed most significant
+// bit first with the last byte padded with zero bits. Input and output go through fixed-size blocks, so memory use
+// doesn't depend on the size of the file.
+
+// Also the size of the blocks of the --interleaved format, which huffman_decoding has to agree on
+constexpr std::size_t block_size = 1 << 20;
+
+struct code_entry {
+   // The code's bits are the low length bits
+   std::uint64_t code = 0;
+   int length = 0;
+   bool present = false;
+};
+
+using code_table = std::array<code_entry, 256>;
+
+// Parses the {"byte":"bits",...} object huffman_encoding writes. Returns false if it isn't one.
+bool parse_mapping(const std::string& json, code_table& table)
+{
+   std::size_t pos = 0;
+   const auto skip_space = [&]() {
+      while (pos < json.size() && std::isspace(static_cast<unsigned char>(json[pos]))) {
+         pos += 1;
+      }
+   };
+   const auto expect = [&](char c) {
+      skip_space();
+      if (pos < json.size() && json[pos] == c) {
+         pos += 1;
+         return true;
+      }
+      return false;
+   };
+   const auto parse_string = [&](std::string& out) {
+      if (!expect('"')) {
+         return false;
+      }
+      const auto end = json.find('"', pos);
+      if (end == std::string::npos) {
+         return false;
+      }
+      out = json.substr(pos, end - pos);
+      pos = end + 1;
+      return true;
+   };
+
+   if (!expect('{')) {
+      return false;
+   }
+   if (expect('}')) {
+      return true;
+   }
+   std::string key;
+   std::string bits;
+   do {
+      if (!parse_string(key) || !expect(':') || !parse_string(bits)) {
+         return false;
+      }
+      if (key.empty() || key.size() > 3 || key.find_first_not_of("0123456789") != std::string::npos
+          || std::stoi(key) > 255) {
+         std::cerr << "Invalid byte value " << key << " in mapping\n";
+         return false;
+      }
+      // Needs more than 2^64 bytes of input to give a longer code
+      if (bits.size() > 64 || bits.find_first_not_of("01") != std::string::npos) {
+         std::cerr << "Invalid code " << bits << " in mapping\n";
+         return false;
+      }
+      auto& entry = table[std::stoi(key)];
+      entry = {0, static_cast<int>(bits.size()), true};
+      for (const auto c : bits) {
+         entry.code = (entry.code << 1) | (c == '1');
+      }
+   } while (expect(','));
+   return expect('}');
+}
+
+// Packs bits most significant first through a 64-bit accumulator, appending them to a buffer 32 at a time
+class bit_writer {
+public:
+   explicit bit_writer(std::vector<std::uint8_t>& out) noexcept : out_{out} {}
+
+   void put(std::uint64_t code, int length)
+   {
+      if (length > 32) {
+         put32(code >> 32, length - 32);
+         put32(code & 0xFFFF'FFFF, 32);
+      }
+      else {
+         put32(code, length);
+      }
+   }
+
+   // Pads the last byte with zero bits and appends what's left
+   void finish()
+   {
+      while (num_bits_ > 0) {
+         const int take = std::min(num_bits_, 8);
+         out_.push_back(static_cast<std::uint8_t>((bits_ >> (num_bits_ - take)) << (8 - take)));
+         num_bits_ -= take;
+      }
+   }
+
+private:
+   // The accumulator holds fewer than 32 bits between calls, so up to 32 more always fit
+   void put32(std::uint64_t code, int length)
+   {
+      bits_ = (bits_ << length) | code;
+      num_bits_ += length;
+      if (num_bits_ >= 32) {
+         num_bits_ -= 32;
+         const auto word = static_cast<std::uint32_t>(bits_ >> num_bits_);
+         out_.push_back(static_cast<std::uint8_t>(word >> 24));
+         out_.push_back(static_cast<std::uint8_t>(word >> 16));
+         out_.push_back(static_cast<std::uint8_t>(word >> 8));
+         out_.push_back(static_cast<std::uint8_t>(word));
+      }
+   }
+
+   std::uint64_t bits_ = 0;
+   int num_bits_ = 0;
+   std::vector<std::uint8_t>& out_;
+};
+
+// Returns false after printing why if a byte has no code
+bool encode(const code_table& table, std::span<const std::uint8_t> data, bit_writer& writer)
+{
+   for (const auto c : data) {
+      const auto& entry = table[c];
+      if (!entry.present) {
+         std::cerr << "No code for byte " << static_cast<int>(c) << " in mapping\n";
+         return false;
+      }
+      writer.put(entry.code, entry.length);
+   }
+   return true;
+}
+
+// With --interleaved each block of the input is coded as num_interleaved independent streams so that
+// huffman_decoding --interleaved can decode them side by side. A block is cut into streams of a quarter of it each,
+// rounded up, so the last stream is shorter or even empty. Each stream is padded to whole bytes, and the block is
+// written as a jump table of the streams' sizes in bytes as 32-bit little-endian integers followed by the streams.
+constexpr std::size_t num_interleaved = 4;
+
+// Appends the block to out. Returns false after printing why if a byte has no code.
+bool write_interleaved_block(
+   const code_table& table, std::span<const std::uint8_t> block,
+   std::array<std::vector<std::uint8_t>, num_interleaved>& streams, std::vector<std::uint8_t>& out)
+{
+   const auto stream_size = (block.size() + num_interleaved - 1) / num_interleaved;
+   for (std::size_t s = 0; s < num_interleaved; ++s) {
+      const auto begin = std::min(s * stream_size, block.size());
+      streams[s].clear();
+      bit_writer writer{streams[s]};
+      if (!encode(table, block.subspan(begin, std::min(stream_size, block.size() - begin)), writer)) {
+         return false;
+      }
+      writer.finish();
+      for (int shift = 0; shift < 32; shift += 8) {
+         out.push_back(static_cast<std::uint8_t>(streams[s].size() >> shift));
+      }
+   }
+   for (const auto& stream : streams) {
+      out.insert(out.end(), stream.begin(), stream.end());
+   }
+   return true;
+}
+
+// Appends the block in the format chosen, one stream or interleaved. Returns false after printing why if a byte
+// has no code.
+bool write_block(
+   const code_table& table, std::span<const std::uint8_t> block, bool interleaved,
+   std::array<std::vector<std::uint8_t>, num_interleaved>& streams, std::vector<std::uint8_t>& out)
+{
+   if (interleaved) {
+      return write_interleaved_block(table, block, streams, out);
+   }
+   bit_writer writer{out};
+   if (!encode(table, block, writer)) {
+      return false;
+   }
+   writer.finish();
+   return true;
+}
+
+void append_u64(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+   for (int shift = 0; shift < 64; shift += 8) {
+      out.push_back(static_cast<std::uint8_t>(value >> shift));
+   }
+}
+
+// Runs work on num_threads threads, this one included, and waits for them all
+template<typename Work>
+void run_on_threads(unsigned num_threads, Work work)
+{
+   std::vector<std::jthread> threads;
+   for (unsigned i = 1; i < num_threads; ++i) {
+      threads.emplace_back(work);
+   }
+   work();
+}
+
+// With --blocks the output is a container of independently coded blocks of block_size bytes of input, the last
+// one shorter, so they can be coded and decoded in parallel and any one of them decoded on its own. All integers
+// are 64-bit little-endian:
+//    The magic bytes HUFBLOCK
+//    Flags, where bit 0 means each block is in the --interleaved format rather than one stream
+//    The block size, the input size and the number of blocks
+//    The block index: the size in bytes of each compressed block in turn
+//    The blocks, each padded to whole bytes
+constexpr std::string_view block_magic = "HUFBLOCK";
+
+// Reads and codes batches of blocks on num_threads threads, writing them out in order and then the index in front
+bool compress_blocks(
+   const code_table& table, bool interleaved, unsigned num_threads, std::ifstream& fin, std::ofstream& fout)
+{
+   fin.seekg(0, std::ios::end);
+   const auto input_size = static_cast<std::uint64_t>(fin.tellg());
+   fin.seekg(0);
+   const auto num_blocks = (input_size + block_size - 1) / block_size;
+
+   std::vector<std::uint8_t> header{block_magic.begin(), block_magic.end()};
+   append_u64(header, interleaved ? 1 : 0);
+   append_u64(header, block_size);
+   append_u64(header, input_size);
+   append_u64(header, num_blocks);
+   // The index is filled in once every block's size is known
+   const auto index_pos = header.size();
+   header.resize(header.size() + num_blocks * 8);
+   fout.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+   // A few blocks for each thread so one slow block doesn't leave the others idle for long
+   const std::size_t batch_blocks = num_threads * 4;
+   std::vector<std::uint8_t> input(batch_blocks * block_size);
+   std::vector<std::vector<std::uint8_t>> outputs(batch_blocks);
+   std::vector<std::uint8_t> index;
+   while (fin) {
+      fin.read(reinterpret_cast<char*>(input.data()), input.size());
+      const auto batch = std::span{input}.first(static_cast<std::size_t>(fin.gcount()));
+      const auto num_batch_blocks = (batch.size() + block_size - 1) / block_size;
+      std::atomic<std::size_t> next_block = 0;
+      std::atomic<bool> ok = true;
+      run_on_threads(num_threads, [&]() {
+         std::array<std::vector<std::uint8_t>, num_interleaved> streams;
+         for (auto i = next_block++; i < num_batch_blocks && ok; i = next_block++) {
+            outputs[i].clear();
+            const auto block = batch.subspan(i * block_size, std::min(block_size, batch.size() - i * block_size));
+            if (!write_block(table, block, interleaved, streams, outputs[i])) {
+               ok = false;
+            }
+         }
+      });
+      if (!ok) {
+         return false;
+      }
+      for (std::size_t i = 0; i < num_batch_blocks; ++i) {
+         fout.write(reinterpret_cast<const char*>(outputs[i].data()), outputs[i].size());
+         append_u64(index, outputs[i].size());
+      }
+   }
+   fout.seekp(static_cast<std::streamoff>(index_pos));
+   fout.write(reinterpret_cast<const char*>(index.data()), index.size());
+   return true;
+}
+
+// Codes the input as one stream, or interleaved blocks one after another, a block at a time
+bool compress_stream(const code_table& table, bool interleaved, std::ifstream& fin, std::ofstream& fout)
+{
+   std::vector<std::uint8_t> block(block_size);
+   std::vector<std::uint8_t> out;
+   std::array<std::vector<std::uint8_t>, num_interleaved> streams;
+   bit_writer writer{out};
+   while (fin) {
+      fin.read(reinterpret_cast<char*>(block.data()), block.size());
+      const auto data = std::span{block}.first(static_cast<std::size_t>(fin.gcount()));
+      if (interleaved ? !data.empty() && !write_interleaved_block(table, data, streams, out)
+                      : !encode(table, data, writer)) {
+         return false;
+      }
+      fout.write(reinterpret_cast<const char*>(out.data()), out.size());
+      out.clear();
+   }
+   writer.finish();
+   fout.write(reinterpret_cast<const char*>(out.data()), out.size());
+   return true;
+}
+
+int main(int argc, const char* argv[])
+{
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " [--interleaved] [--blocks] [--threads num_threads] json_encoding file_to_compress"
+                   " file_to_save_to\n";
+      return 2;
+   };
+   bool interleaved = false;
+   bool blocks = false;
+   // Only --blocks output is coded in parallel
+   unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+   int first_arg = 1;
+   for (; first_arg < argc; ++first_arg) {
+      const std::string_view arg = argv[first_arg];
+      if (arg == "--interleaved") {
+         interleaved = true;
+      }
+      else if (arg == "--blocks") {
+         blocks = true;
+      }
+      else if (arg == "--threads" && first_arg + 1 < argc) {
+         first_arg += 1;
+         const auto threads = std::atoi(argv[first_arg]);
+         if (threads <= 0) {
+            std::cerr << "Error parsing number of threads\n";
+            return 2;
+         }
+         num_threads = static_cast<unsigned>(threads);
+      }
+      else {
+         break;
+      }
+   }
+   if (argc != first_arg + 3) {
+      return usage();
+   }
+
+   std::ifstream json_in{argv[first_arg]};
+   const std::string json{std::istreambuf_iterator<char>{json_in}, std::istreambuf_iterator<char>{}};
+   code_table table;
+   if (!json_in || !parse_mapping(json, table)) {
+      std::cerr << "Could not read mapping from " << argv[first_arg] << '\n';
+      return 1;
+   }
+
+   std::ifstream fin{argv[first_arg + 1], std::ios::binary};
+   if (!fin) {
+      std::cerr << "Could not open " << argv[first_arg + 1] << '\n';
+      return 1;
+   }
+   std::ofstream fout{argv[first_arg + 2], std::ios::binary};
+   if (blocks ? !compress_blocks(table, interleaved, num_threads, fin, fout)
+              : !compress_stream(table, interleaved, fin, fout)) {
+      return 1;
+   }
+   if (!fout) {
+      std::cerr << "Writing " << argv[first_arg + 2] << " failed\n";
+      return 1;
+   }
+}
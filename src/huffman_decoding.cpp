@@ -1,7 +1,20 @@
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 template<typename T>
@@ -13,67 +26,567 @@ std::vector<T> read_file(const std::string& read_loc)
    const auto size = fin.tellg();
    fin.seekg(0);
    std::vector<T> to_ret;
-   to_ret.resize(size);
-   fin.read(reinterpret_cast<char*>(to_ret.data()), size);
+   to_ret.resize(size / sizeof(T));
+   fin.read(reinterpret_cast<char*>(to_ret.data()), to_ret.size() * sizeof(T));
    return to_ret;
 }
 
-// Should really make this an iterator but lazy
-struct bit_reader {
-   bool get_bit()
+// Reads bits most significant first through a 64-bit buffer that's topped up a whole word at a time, so there's
+// one refill for several codes rather than a branch per bit. Past the end of the data it reads zeros; overran()
+// says whether any of those were consumed.
+class bit_reader {
+public:
+   bit_reader() noexcept = default;
+   explicit bit_reader(std::span<const std::uint8_t> data) noexcept : data_{data} {}
+
+   // Leaves at least 56 bits in the buffer
+   void refill() noexcept
    {
-      if (num_bits == 0) {
-         if (current_loc >= data->size()) {
-            std::cerr << "Ran out of data to read\n";
-            std::exit(2);
+      if (next_byte_ + 8 <= data_.size()) {
+         // Bits of the last byte loaded that don't fit are ORed in again, unchanged, by the next refill
+         std::uint64_t word;
+         std::memcpy(&word, data_.data() + next_byte_, 8);
+         if constexpr (std::endian::native == std::endian::little) {
+            word = std::byteswap(word);
          }
-         current = (*data)[current_loc];
-         current_loc += 1;
-         num_bits = 8;
+         buffer_ |= word >> available_;
+         next_byte_ += (63 - available_) >> 3;
+         available_ |= 56;
+      }
+      else {
+         while (available_ <= 56) {
+            const std::uint64_t byte = next_byte_ < data_.size() ? data_[next_byte_] : 0;
+            buffer_ |= byte << (56 - available_);
+            next_byte_ += 1;
+            available_ += 8;
+         }
+      }
+   }
+
+   // The next num_bits bits, which must be from 1 to the number available
+   std::uint32_t peek(int num_bits) const noexcept { return static_cast<std::uint32_t>(buffer_ >> (64 - num_bits)); }
+
+   void consume(int num_bits) noexcept
+   {
+      buffer_ <<= num_bits;
+      available_ -= num_bits;
+   }
+
+   int available() const noexcept { return available_; }
+
+   // The bytes before this have all been loaded into the buffer and won't be read again
+   std::size_t bytes_read() const noexcept { return std::min(next_byte_, data_.size()); }
+
+   bool overran() const noexcept { return next_byte_ * 8 - available_ > data_.size() * 8; }
+
+private:
+   std::uint64_t buffer_ = 0;
+   int available_ = 0;
+   std::size_t next_byte_ = 0;
+   std::span<const std::uint8_t> data_;
+};
+
+constexpr std::uint16_t leaf_bit = 0b1000'0000'0000'0000;
+
+// Codes of up to this many bits are decoded with one table lookup, longer ones finish with a walk of the tree. At
+// 11 bits the table is 8KB so it stays in L1, and codes from huffman_encoding --max-length 11 never need the walk.
+constexpr int table_bits = 11;
+// Lookups that always fit in the bits a refill leaves
+constexpr int lookups_per_refill = 56 / table_bits;
+
+struct decode_entry {
+   // The first symbol in the low byte and the second, if any, in the high byte. When num_symbols is 0 the code is
+   // longer than table_bits and this is the tree node table_bits bits lead to.
+   std::uint16_t value;
+   std::uint8_t num_symbols;
+   // Bits taken by all of the symbols
+   std::uint8_t length;
+};
+
+// Exits if a node's children are outside the tree, so walking it needs no bounds checks
+void check_tree(const std::vector<std::uint16_t>& tree)
+{
+   if (tree.empty()) {
+      std::cerr << "Huffman tree is empty\n";
+      std::exit(2);
+   }
+   for (std::size_t i = 0; i < tree.size(); ++i) {
+      if (!(tree[i] & leaf_bit) && (i + 1 >= tree.size() || i + tree[i] >= tree.size())) {
+         std::cerr << "Trying to access tree out of bounds\n";
+         std::exit(2);
       }
-      const auto to_output = current & 0b1000'0000;
-      current <<= 1;
-      num_bits -= 1;
-      return to_output;
    }
+}
 
-   std::uint8_t current;
-   int num_bits;
-   std::size_t current_loc;
-   const std::vector<std::uint8_t>* data;
+struct canonical_code {
+   std::uint64_t code;
+   int length;
+   std::uint8_t symbol;
 };
 
+// Appends the subtree for codes, which all start with the same depth bits and are sorted by code
+void add_subtree(std::span<const canonical_code> codes, int depth, std::vector<std::uint16_t>& tree)
+{
+   const auto start = tree.size();
+   tree.push_back(0);
+   if (codes.size() == 1 && codes.front().length == depth) {
+      tree[start] = leaf_bit | codes.front().symbol;
+      return;
+   }
+   const auto ones = std::ranges::partition_point(
+      codes, [depth](const canonical_code& c) { return !((c.code >> (c.length - 1 - depth)) & 1); });
+   const auto num_zeros = static_cast<std::size_t>(ones - codes.begin());
+   add_subtree(codes.first(num_zeros), depth + 1, tree);
+   tree[start] = static_cast<std::uint16_t>(tree.size() - start);
+   add_subtree(codes.subspan(num_zeros), depth + 1, tree);
+}
+
+// Builds the raw tree for the canonical code that huffman_encoding --max-length describes with a length for each
+// byte, 0 for bytes that don't occur. The codes are assigned shortest first and in byte order within a length.
+std::vector<std::uint16_t> tree_from_code_lengths(const std::vector<std::uint8_t>& lengths)
+{
+   if (lengths.size() != 256) {
+      std::cerr << "Code lengths must be 256 bytes, not " << lengths.size() << '\n';
+      std::exit(2);
+   }
+   constexpr int max_length = 32;
+   if (std::ranges::any_of(lengths, [](std::uint8_t length) { return length > max_length; })) {
+      std::cerr << "Code lengths can be at most " << max_length << " bits\n";
+      std::exit(2);
+   }
+   std::vector<canonical_code> codes;
+   std::uint64_t code = 0;
+   int last_length = 0;
+   for (int length = 1; length <= max_length; ++length) {
+      for (std::size_t symbol = 0; symbol < lengths.size(); ++symbol) {
+         if (lengths[symbol] == length) {
+            code <<= length - last_length;
+            last_length = length;
+            codes.push_back({code, length, static_cast<std::uint8_t>(symbol)});
+            code += 1;
+         }
+      }
+   }
+   // A lone byte has the code 0, and both branches of the root lead to it
+   if (codes.size() == 1 && codes.front().length == 1) {
+      return {1, static_cast<std::uint16_t>(leaf_bit | codes.front().symbol)};
+   }
+   // Every node needs both children, so the codes have to use up the whole code space
+   if (codes.empty() || code != std::uint64_t{1} << last_length) {
+      std::cerr << "Code lengths don't describe a complete code\n";
+      std::exit(2);
+   }
+   std::vector<std::uint16_t> tree;
+   add_subtree(codes, 0, tree);
+   return tree;
+}
+
+std::size_t next_node(const std::vector<std::uint16_t>& tree, std::size_t node, bool bit) noexcept
+{ return bit ? node + tree[node] : node + 1; }
+
+struct walk_result {
+   std::size_t node;
+   int bits_used;
+};
+
+// Follows the low num_bits bits of bits from node, most significant first, stopping early at a leaf
+walk_result walk_tree(const std::vector<std::uint16_t>& tree, std::size_t node, std::uint32_t bits, int num_bits)
+{
+   int used = 0;
+   while (used < num_bits && !(tree[node] & leaf_bit)) {
+      node = next_node(tree, node, (bits >> (num_bits - 1 - used)) & 1);
+      used += 1;
+   }
+   return {node, used};
+}
+
+// Every table_bits bit prefix maps to the symbols whose codes it starts with, two of them when both codes fit
+std::vector<decode_entry> build_decode_table(const std::vector<std::uint16_t>& tree)
+{
+   std::vector<decode_entry> table(std::size_t{1} << table_bits);
+   for (std::uint32_t index = 0; index < table.size(); ++index) {
+      const auto first = walk_tree(tree, 0, index, table_bits);
+      auto& entry = table[index];
+      if (!(tree[first.node] & leaf_bit)) {
+         entry = {static_cast<std::uint16_t>(first.node), 0, table_bits};
+         continue;
+      }
+      entry = {static_cast<std::uint16_t>(tree[first.node] & 0xFF), 1, static_cast<std::uint8_t>(first.bits_used)};
+
+      const int bits_left = table_bits - first.bits_used;
+      const auto second = walk_tree(tree, 0, index & ((1u << bits_left) - 1), bits_left);
+      if (tree[second.node] & leaf_bit) {
+         entry.value |= (tree[second.node] & 0xFF) << 8;
+         entry.num_symbols = 2;
+         entry.length += second.bits_used;
+      }
+   }
+   return table;
+}
+
+// Finishes decoding a symbol from node for a code too long for the table, following up to 32 bits at a time. The
+// caller checks for running out of data.
+std::uint8_t decode_slow(const std::vector<std::uint16_t>& tree, std::size_t node, bit_reader& reader)
+{
+   while (!(tree[node] & leaf_bit)) {
+      reader.refill();
+      const auto walked = walk_tree(tree, node, reader.peek(32), 32);
+      reader.consume(walked.bits_used);
+      node = walked.node;
+   }
+   return tree[node] & 0xFF;
+}
+
+// Calls f with each index below count in turn, unrolled so that every index is a constant, and returns whether it
+// returned true for all of them
+template<std::size_t count, typename Func>
+bool all_unrolled(Func&& f)
+{
+   return [&]<std::size_t... i>(std::index_sequence<i...>) {
+      return (f(i) & ...);
+   }(std::make_index_sequence<count>{});
+}
+
+// Fills each output with the symbols from the matching reader. The streams are independent, so taking a lookup
+// from each in turn lets the CPU work on all of them at once instead of waiting on one chain of shifts and loads.
+// Returns false if any of them runs out of data first.
+template<std::size_t num_streams>
+bool decode(
+   const std::vector<std::uint16_t>& tree, const std::vector<decode_entry>& table,
+   std::array<bit_reader, num_streams>& readers, const std::array<std::span<std::uint8_t>, num_streams>& outputs)
+{
+   // Byte stores may alias anything whose address has been taken, which would have every lookup reload the
+   // readers from memory. So the fast loop works on copies whose addresses never are, only ever indexed by
+   // constants so each stream's state can have its own registers.
+   auto local_readers = readers;
+   std::array<std::uint8_t*, num_streams> next;
+   std::array<std::uint8_t*, num_streams> fast_end;
+   const auto* const entries = table.data();
+
+   const auto lookup = [&](std::size_t s) {
+      auto& reader = local_readers[s];
+      auto& out = next[s];
+      const auto entry = entries[reader.peek(table_bits)];
+      reader.consume(entry.length);
+      if (entry.num_symbols == 0) {
+         auto slow_reader = reader;
+         *out = decode_slow(tree, entry.value, slow_reader);
+         out += 1;
+         // The walk can leave fewer bits than the rest of the lookups need
+         slow_reader.refill();
+         reader = slow_reader;
+         return true;
+      }
+      out[0] = entry.value & 0xFF;
+      out[1] = entry.value >> 8;
+      out += entry.num_symbols;
+      return true;
+   };
+
+   // Each lookup can write two symbols, so a round needs room for all of them; the rest are decoded one by one
+   const bool fast = all_unrolled<num_streams>([&](std::size_t s) {
+      next[s] = outputs[s].data();
+      fast_end[s] = next[s] + outputs[s].size() - std::min<std::size_t>(outputs[s].size(), 2 * lookups_per_refill);
+      return outputs[s].size() >= 2 * lookups_per_refill;
+   });
+   while (fast && all_unrolled<num_streams>([&](std::size_t s) { return next[s] <= fast_end[s]; })) {
+      all_unrolled<num_streams>([&](std::size_t s) {
+         local_readers[s].refill();
+         return true;
+      });
+      for (int i = 0; i < lookups_per_refill; ++i) {
+         all_unrolled<num_streams>(lookup);
+      }
+   }
+   // Past the end of the data readers only ever give zeros, so this can wait until the fast loop is done
+   if (!all_unrolled<num_streams>([&](std::size_t s) { return !local_readers[s].overran(); })) {
+      return false;
+   }
+   return all_unrolled<num_streams>([&](std::size_t s) {
+      auto& reader = readers[s];
+      reader = local_readers[s];
+      for (auto* end = outputs[s].data() + outputs[s].size(); next[s] < end; ++next[s]) {
+         *next[s] = decode_slow(tree, 0, reader);
+         if (reader.overran()) {
+            return false;
+         }
+      }
+      return true;
+   });
+}
+
+// The format huffman_compress --interleaved writes. The input is cut into blocks of interleaved_block_size bytes,
+// the last one shorter, and each block into num_interleaved streams of a quarter of it each, rounded up, so the
+// last stream is shorter or even empty. Each stream is coded on its own and padded to whole bytes. A block is a
+// jump table of the streams' sizes in bytes as 32-bit little-endian integers followed by the streams. The block
+// size has to match huffman_compress's.
+constexpr std::size_t interleaved_block_size = 1 << 20;
+constexpr std::size_t num_interleaved = 4;
+constexpr std::size_t jump_table_size = num_interleaved * 4;
+
+// Leaves data starting after the blocks decoded. Returns false if it runs out or doesn't hold the streams the jump
+// tables say it does.
+bool decode_interleaved(
+   const std::vector<std::uint16_t>& tree, const std::vector<decode_entry>& table,
+   std::span<const std::uint8_t>& data, std::span<std::uint8_t> output)
+{
+   while (!output.empty()) {
+      const auto block = output.first(std::min(output.size(), interleaved_block_size));
+      output = output.subspan(block.size());
+      if (data.size() < jump_table_size) {
+         return false;
+      }
+      const auto stream_size = (block.size() + num_interleaved - 1) / num_interleaved;
+      std::array<bit_reader, num_interleaved> readers{};
+      std::array<std::span<std::uint8_t>, num_interleaved> outputs;
+      std::size_t offset = jump_table_size;
+      for (std::size_t s = 0; s < num_interleaved; ++s) {
+         const auto* entry = data.data() + s * 4;
+         const std::size_t size = entry[0] | (entry[1] << 8) | (entry[2] << 16) | (std::size_t{entry[3]} << 24);
+         if (size > data.size() - offset) {
+            return false;
+         }
+         readers[s] = bit_reader{data.subspan(offset, size)};
+         offset += size;
+         const auto begin = std::min(s * stream_size, block.size());
+         outputs[s] = block.subspan(begin, std::min(stream_size, block.size() - begin));
+      }
+      data = data.subspan(offset);
+      if (!decode(tree, table, readers, outputs)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// The container huffman_compress --blocks writes, described there. Blocks are coded independently of each other.
+constexpr std::string_view block_magic = "HUFBLOCK";
+constexpr std::size_t block_header_size = 40;
+
+struct block_container {
+   bool interleaved;
+   std::uint64_t block_size;
+   std::uint64_t input_size;
+   std::vector<std::span<const std::uint8_t>> blocks;
+
+   // The bytes block i decodes to
+   std::uint64_t decoded_size(std::size_t i) const noexcept
+   {
+      return std::min(block_size, input_size - i * block_size);
+   }
+};
+
+std::uint64_t read_u64(const std::uint8_t* data) noexcept
+{
+   std::uint64_t value = 0;
+   for (int i = 7; i >= 0; --i) {
+      value = (value << 8) | data[i];
+   }
+   return value;
+}
+
+// Returns false if data isn't a container or its header and index don't agree with the data
+bool parse_blocks(std::span<const std::uint8_t> data, block_container& container)
+{
+   if (data.size() < block_header_size || !std::ranges::equal(data.first(block_magic.size()), block_magic)) {
+      return false;
+   }
+   const auto flags = read_u64(data.data() + 8);
+   container.interleaved = (flags & 1) != 0;
+   container.block_size = read_u64(data.data() + 16);
+   container.input_size = read_u64(data.data() + 24);
+   const auto num_blocks = read_u64(data.data() + 32);
+   // An interleaved block has one jump table, so it can't be longer than decode_interleaved takes in one go
+   if (container.block_size == 0 || (container.interleaved && container.block_size > interleaved_block_size)
+       || num_blocks != (container.input_size + container.block_size - 1) / container.block_size
+       || num_blocks > (data.size() - block_header_size) / 8) {
+      return false;
+   }
+   auto blocks = data.subspan(block_header_size + num_blocks * 8);
+   container.blocks.clear();
+   for (std::size_t i = 0; i < num_blocks; ++i) {
+      const auto size = read_u64(data.data() + block_header_size + i * 8);
+      if (size > blocks.size()) {
+         return false;
+      }
+      container.blocks.push_back(blocks.first(size));
+      blocks = blocks.subspan(size);
+   }
+   return true;
+}
+
+bool decode_block(
+   const std::vector<std::uint16_t>& tree, const std::vector<decode_entry>& table, const block_container& container,
+   std::size_t i, std::span<std::uint8_t> output)
+{
+   if (container.interleaved) {
+      auto data = container.blocks[i];
+      return decode_interleaved(tree, table, data, output);
+   }
+   std::array<bit_reader, 1> reader{bit_reader{container.blocks[i]}};
+   return decode(tree, table, reader, std::array{output});
+}
+
+// Decodes the blocks that output holds from first_block on, on num_threads threads, each taking the next block not
+// yet started until none are left
+bool decode_blocks(
+   const std::vector<std::uint16_t>& tree, const std::vector<decode_entry>& table, const block_container& container,
+   std::size_t first_block, unsigned num_threads, std::span<std::uint8_t> output)
+{
+   const auto last_block = first_block + (output.size() + container.block_size - 1) / container.block_size;
+   std::atomic<std::size_t> next_block = first_block;
+   std::atomic<bool> ok = true;
+   const auto work = [&]() {
+      for (auto i = next_block++; i < last_block && ok; i = next_block++) {
+         const auto block = output.subspan((i - first_block) * container.block_size, container.decoded_size(i));
+         if (!decode_block(tree, table, container, i, block)) {
+            ok = false;
+         }
+      }
+   };
+   {
+      std::vector<std::jthread> threads;
+      for (unsigned t = 1; t < num_threads; ++t) {
+         threads.emplace_back(work);
+      }
+      work();
+   }
+   return ok;
+}
+
+constexpr std::uint64_t output_batch_size = 1 << 20;
+
+// Decodes output_size bytes a batch at a time through one buffer, so memory use doesn't grow with the output.
+// decode_batch fills the span it's given, returning false if the data runs out.
+template<typename DecodeBatch>
+bool write_batches(std::ofstream& fout, std::uint64_t output_size, std::uint64_t batch_size, DecodeBatch decode_batch)
+{
+   std::vector<std::uint8_t> buffer(std::min(output_size, batch_size));
+   for (auto remaining = output_size; remaining > 0; remaining -= buffer.size()) {
+      buffer.resize(std::min<std::uint64_t>(remaining, buffer.size()));
+      if (!decode_batch(std::span{buffer})) {
+         return false;
+      }
+      fout.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+   }
+   return true;
+}
+
 int main(int argc, const char* argv[])
 {
-   if (argc != 5) {
-      std::cerr << "Usage:\n" << argv[0] << " huffman_tree to_decompress output_size output_file\n";
+   // With --code-lengths huffman_tree is the code lengths written by huffman_encoding --max-length, with
+   // --interleaved to_decompress is in the format huffman_compress --interleaved writes and with --blocks it's the
+   // container huffman_compress --blocks writes, of which --block decodes just the one block
+   bool code_lengths = false;
+   bool interleaved = false;
+   bool blocks = false;
+   std::optional<std::size_t> only_block;
+   unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+   int first_arg = 1;
+   for (; first_arg < argc; ++first_arg) {
+      const std::string_view arg = argv[first_arg];
+      if (arg == "--code-lengths") {
+         code_lengths = true;
+      }
+      else if (arg == "--interleaved") {
+         interleaved = true;
+      }
+      else if (arg == "--blocks") {
+         blocks = true;
+      }
+      else if (arg == "--block" && first_arg + 1 < argc) {
+         first_arg += 1;
+         only_block = std::strtoull(argv[first_arg], nullptr, 10);
+         blocks = true;
+      }
+      else if (arg == "--threads" && first_arg + 1 < argc) {
+         first_arg += 1;
+         const auto threads = std::atoi(argv[first_arg]);
+         if (threads <= 0) {
+            std::cerr << "Error parsing number of threads\n";
+            return 1;
+         }
+         num_threads = static_cast<unsigned>(threads);
+      }
+      else {
+         break;
+      }
+   }
+   if (argc != first_arg + 4) {
+      std::cerr << "Usage:\n"
+                << argv[0]
+                << " [--code-lengths] [--interleaved | --blocks | --block index] [--threads num_threads] huffman_tree"
+                   " to_decompress output_size output_file\n";
       return 1;
    }
-   const auto output_size = std::atoi(argv[3]);
+   const auto output_size = std::strtoll(argv[first_arg + 2], nullptr, 10);
    if (output_size <= 0) {
       std::cerr << "Invalid output_size of " << output_size << '\n';
       return 1;
    }
-   const auto tree = read_file<std::uint16_t>(argv[1]);
-   const auto to_decompress = read_file<std::uint8_t>(argv[2]);
-
-   std::ofstream fout{argv[4], std::ios::binary};
-   bit_reader reader{0, 0, 0, &to_decompress};
-   for (int i = 0; i < output_size; ++i) {
-      std::size_t decode_loc = 0;
-      while (!(tree[decode_loc] & 0b1000'0000'0000'0000)) {
-         if (decode_loc >= tree.size()) {
-            std::cerr << "Trying to access tree out of bounds\n";
-            return 2;
-         }
-         if (reader.get_bit()) {
-            decode_loc += tree[decode_loc];
-         }
-         else {
-            decode_loc += 1;
-         }
+   const auto tree = code_lengths ? tree_from_code_lengths(read_file<std::uint8_t>(argv[first_arg]))
+                                  : read_file<std::uint16_t>(argv[first_arg]);
+   mapped_file input{argv[first_arg + 1]};
+   const auto to_decompress = input.data();
+   check_tree(tree);
+   const auto table = build_decode_table(tree);
+
+   block_container container;
+   if (blocks) {
+      if (!parse_blocks(to_decompress, container)) {
+         std::cerr << "Not a valid block container\n";
+         return 2;
       }
-      const std::uint8_t to_write = tree[decode_loc] & 0x7FFF;
-      fout.write(reinterpret_cast<const char*>(&to_write), 1);
+      if (only_block && *only_block >= container.blocks.size()) {
+         std::cerr << "There are only " << container.blocks.size() << " blocks\n";
+         return 1;
+      }
+      const auto decoded_size = only_block ? container.decoded_size(*only_block) : container.input_size;
+      if (static_cast<std::uint64_t>(output_size) != decoded_size) {
+         std::cerr << "The output_size of " << output_size << " doesn't match the " << decoded_size
+                   << " bytes in the container\n";
+         return 1;
+      }
+   }
+
+   // Input that's been decoded is released after each batch, and all of the formats are read front to back
+   std::ofstream fout{argv[first_arg + 3], std::ios::binary};
+   const auto size = static_cast<std::uint64_t>(output_size);
+   bool ok;
+   if (only_block) {
+      ok = write_batches(fout, size, size, [&](std::span<std::uint8_t> batch) {
+         return decode_block(tree, table, container, *only_block, batch);
+      });
+   }
+   else if (blocks) {
+      // Enough blocks at a time to keep all of the threads busy
+      std::size_t next_block = 0;
+      ok = write_batches(fout, size, container.block_size * num_threads * 4, [&](std::span<std::uint8_t> batch) {
+         const bool decoded = decode_blocks(tree, table, container, next_block, num_threads, batch);
+         next_block += (batch.size() + container.block_size - 1) / container.block_size;
+         const auto& last = container.blocks[next_block - 1];
+         input.release(static_cast<std::size_t>(last.data() + last.size() - to_decompress.data()));
+         return decoded;
+      });
+   }
+   else if (interleaved) {
+      auto data = to_decompress;
+      ok = write_batches(fout, size, interleaved_block_size, [&](std::span<std::uint8_t> batch) {
+         const bool decoded = decode_interleaved(tree, table, data, batch);
+         input.release(static_cast<std::size_t>(data.data() - to_decompress.data()));
+         return decoded;
+      });
+   }
+   else {
+      std::array<bit_reader, 1> reader{bit_reader{to_decompress}};
+      ok = write_batches(fout, size, output_batch_size, [&](std::span<std::uint8_t> batch) {
+         const bool decoded = decode(tree, table, reader, std::array{batch});
+         input.release(reader[0].bytes_read());
+         return decoded;
+      });
+   }
+   if (!ok) {
+      std::cerr << "Ran out of data to read\n";
+      return 2;
    }
 }
@@ -1,4 +1,7 @@
+#include "mapped_file.hpp"
+
 #include <algorithm>
+#include <barrier>
 #include <cstdint>
 #include <deque>
 #include <fstream>
@@ -6,8 +9,11 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <ranges>
 #include <span>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 struct node {
@@ -90,46 +96,224 @@ std::size_t build_raw_tree(const node& n, std::vector<std::uint16_t>& raw_tree)
    return start_loc;
 }
 
+void write_json(const char* path, const std::map<std::uint64_t, std::string>& mapping)
+{
+   std::ofstream json_out{path};
+   json_out << '{';
+   bool comma = false;
+   for (const auto& [key, value] : mapping) {
+      if (comma) {
+         json_out << ',';
+      }
+      json_out << std::quoted(std::to_string(key)) << ':' << std::quoted(value);
+      comma = true;
+   }
+   json_out << '}';
+}
+
+// Optimal code lengths of at most max_length bits for the bytes that occur, by package-merge. Bytes that don't
+// occur get 0. A lone byte gets a 1 bit code so every code has a length.
+std::array<std::uint8_t, 256> limited_code_lengths(const std::array<std::uint64_t, 256>& data_counts, int max_length)
+{
+   // Either a byte or a package of the two items before it in the previous list
+   struct item {
+      std::uint64_t weight;
+      int symbol;
+      std::size_t left;
+      std::size_t right;
+   };
+   std::vector<item> items;
+   for (const auto [value, count] : std::views::enumerate(data_counts)) {
+      if (count > 0) {
+         items.push_back({count, static_cast<int>(value), 0, 0});
+      }
+   }
+   std::ranges::stable_sort(items, {}, &item::weight);
+   const auto num_symbols = items.size();
+
+   std::array<std::uint8_t, 256> lengths{};
+   if (num_symbols == 0) {
+      return lengths;
+   }
+   if (num_symbols == 1) {
+      lengths[items.front().symbol] = 1;
+      return lengths;
+   }
+
+   // Each round packages pairs of the previous list and merges them back in with the bytes, which the first
+   // num_symbols items always are
+   std::vector<std::size_t> list(num_symbols);
+   std::iota(list.begin(), list.end(), 0);
+   for (int round = 1; round < max_length; ++round) {
+      std::vector<std::size_t> packages;
+      for (std::size_t i = 0; i + 1 < list.size(); i += 2) {
+         const auto weight = items[list[i]].weight + items[list[i + 1]].weight;
+         if (weight < items[list[i]].weight) {
+            std::cerr << "Overflow of std::uint64_t when packaging codes, exiting.\n";
+            std::exit(1);
+         }
+         items.push_back({weight, -1, list[i], list[i + 1]});
+         packages.push_back(items.size() - 1);
+      }
+      std::vector<std::size_t> merged;
+      std::ranges::merge(
+         std::views::iota(std::size_t{0}, num_symbols), packages, std::back_inserter(merged), {},
+         [&](std::size_t i) { return items[i].weight; }, [&](std::size_t i) { return items[i].weight; });
+      list = std::move(merged);
+   }
+
+   // Each time a byte appears in the first 2n - 2 items, packages included, adds a bit to its code
+   std::vector<std::size_t> to_count(list.begin(), list.begin() + (2 * num_symbols - 2));
+   while (!to_count.empty()) {
+      const auto& counted = items[to_count.back()];
+      to_count.pop_back();
+      if (counted.symbol >= 0) {
+         lengths[counted.symbol] += 1;
+      }
+      else {
+         to_count.push_back(counted.left);
+         to_count.push_back(counted.right);
+      }
+   }
+   return lengths;
+}
+
+// Canonical codes for the lengths: shorter codes first, and in byte order within a length, each one more than the
+// last with zeros added when the length grows. The codes are then fully described by their lengths.
+std::map<std::uint64_t, std::string> canonical_mapping(const std::array<std::uint8_t, 256>& lengths)
+{
+   std::map<std::uint64_t, std::string> mapping;
+   std::uint64_t code = 0;
+   int last_length = 0;
+   for (int length = 1; length <= 64; ++length) {
+      for (const auto [value, value_length] : std::views::enumerate(lengths)) {
+         if (value_length != length) {
+            continue;
+         }
+         code <<= length - last_length;
+         last_length = length;
+         std::string bits;
+         for (int bit = length - 1; bit >= 0; --bit) {
+            bits += (code >> bit) & 1 ? '1' : '0';
+         }
+         mapping[value] = std::move(bits);
+         code += 1;
+      }
+   }
+   return mapping;
+}
+
+constexpr std::size_t count_chunk_size = 1 << 22;
+
+// Counts the bytes of a file a chunk at a time so only the chunks being counted have to be in memory. Each of
+// num_threads threads takes every num_threads-th chunk into its own histogram, and after each round they wait for
+// each other so the chunks behind all of them can be released.
+std::array<std::uint64_t, 256> count_bytes(mapped_file& input, unsigned num_threads)
+{
+   const auto data = input.data();
+   const auto num_chunks = (data.size() + count_chunk_size - 1) / count_chunk_size;
+   const auto num_rounds = (num_chunks + num_threads - 1) / num_threads;
+   // Run by the last thread to finish each round
+   const auto release_round = [&input, num_threads, rounds_done = std::size_t{0}]() mutable noexcept {
+      rounds_done += 1;
+      input.release(rounds_done * num_threads * count_chunk_size);
+   };
+   std::barrier round_done{num_threads, release_round};
+   std::vector<std::array<std::uint64_t, 256>> thread_counts(num_threads);
+   {
+      std::vector<std::jthread> threads;
+      for (unsigned t = 0; t < num_threads; ++t) {
+         threads.emplace_back([&, t]() {
+            std::array<std::uint64_t, 256> counts{};
+            for (std::size_t round = 0; round < num_rounds; ++round) {
+               const auto begin = std::min(data.size(), (round * num_threads + t) * count_chunk_size);
+               for (const auto c : data.subspan(begin, std::min(count_chunk_size, data.size() - begin))) {
+                  counts[c] += 1;
+               }
+               round_done.arrive_and_wait();
+            }
+            thread_counts[t] = counts;
+         });
+      }
+   }
+   std::array<std::uint64_t, 256> counts{};
+   for (const auto& partial : thread_counts) {
+      for (std::size_t c = 0; c < counts.size(); ++c) {
+         counts[c] += partial[c];
+      }
+   }
+   return counts;
+}
+
 int main(int argc, const char* argv[])
 {
-   if (argc < 4) {
-      std::cerr << "Usage:\n" << argv[0] << " json_output raw_tree_output input_files...\n";
+   const auto usage = [&]() {
+      std::cerr << "Usage:\n"
+                << argv[0] << " [--max-length bits] [--threads num_threads] json_output tree_output input_files...\n";
       return 2;
+   };
+   // With --max-length the codes are canonical and limited to that many bits, and the tree output is just the
+   // 256 code lengths in byte order
+   int max_length = 0;
+   unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+   int first_arg = 1;
+   for (; first_arg + 1 < argc; first_arg += 2) {
+      const std::string_view arg = argv[first_arg];
+      if (arg == "--max-length") {
+         max_length = std::atoi(argv[first_arg + 1]);
+         if (max_length <= 0 || max_length > 32) {
+            std::cerr << "Invalid maximum code length, it must be from 1 to 32\n";
+            return 2;
+         }
+      }
+      else if (arg == "--threads") {
+         const auto threads = std::atoi(argv[first_arg + 1]);
+         if (threads <= 0) {
+            std::cerr << "Error parsing number of threads\n";
+            return 2;
+         }
+         num_threads = static_cast<unsigned>(threads);
+      }
+      else {
+         break;
+      }
+   }
+   if (argc < first_arg + 3) {
+      return usage();
    }
+   const char* json_output = argv[first_arg];
+   const char* tree_output = argv[first_arg + 1];
+
    std::array<std::uint64_t, 256> data_counts;
    std::ranges::fill(data_counts, 0);
-   for (int i = 3; i < argc; ++i) {
-      std::ifstream fin{argv[i], std::ios::binary};
-      fin.seekg(0, std::ios::end);
-      const auto size = fin.tellg();
-      fin.seekg(0);
-      std::vector<std::uint8_t> data;
-      data.resize(size);
-      fin.read(reinterpret_cast<char*>(data.data()), size);
-
-      for (const auto c : data) {
-         data_counts[c] += 1;
-         if (data_counts[c] == 0) {
+   for (int i = first_arg + 2; i < argc; ++i) {
+      mapped_file input{argv[i]};
+      const auto counts = count_bytes(input, num_threads);
+      for (std::size_t c = 0; c < counts.size(); ++c) {
+         data_counts[c] += counts[c];
+         if (data_counts[c] < counts[c]) {
             std::cerr << "std::uint64_t overflowed, exiting.\n";
             std::exit(1);
          }
       }
    }
+   if (max_length > 0) {
+      const auto num_symbols = std::ranges::count_if(data_counts, [](std::uint64_t count) { return count > 0; });
+      if (num_symbols > (std::int64_t{1} << max_length)) {
+         std::cerr << num_symbols << " different bytes don't fit in codes of " << max_length << " bits\n";
+         return 1;
+      }
+      const auto lengths = limited_code_lengths(data_counts, max_length);
+      write_json(json_output, canonical_mapping(lengths));
+      std::ofstream lengths_out{tree_output, std::ios::binary};
+      lengths_out.write(reinterpret_cast<const char*>(lengths.data()), lengths.size());
+      return 0;
+   }
+
    const auto tree = create_tree(data_counts);
    std::map<std::uint64_t, std::string> mapping;
    build_mapping(tree, mapping);
-
-   std::ofstream json_out{argv[1]};
-   json_out << '{';
-   bool comma = false;
-   for (const auto& [key, value] : mapping) {
-      if (comma) {
-         json_out << ',';
-      }
-      json_out << std::quoted(std::to_string(key)) << ':' << std::quoted(value);
-      comma = true;
-   }
-   json_out << '}';
+   write_json(json_output, mapping);
 
    // This tree format is designed for speed of decoding rather than minimal size
    // Format is as follows:
@@ -138,7 +322,7 @@ int main(int argc, const char* argv[])
    //    If the top-most bit is not set, the low 15-bits are the offset to the right child
    //    The left child is always one integer ahead
    // The format is little-endian (technically platform native)
-   std::ofstream tree_out{argv[2], std::ios::binary};
+   std::ofstream tree_out{tree_output, std::ios::binary};
    std::vector<std::uint16_t> raw_tree;
    build_raw_tree(tree, raw_tree);
    tree_out.write(reinterpret_cast<const char*>(raw_tree.data()), raw_tree.size() * 2);
@@ -0,0 +1,73 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <span>
+
+// A file mapped read-only, so pages are read in as they're first touched instead of the whole file being copied
+// up front. The sequential hint has the kernel read well ahead, and release() drops pages already read, so how
+// much of the file is resident doesn't grow with its size.
+class mapped_file {
+public:
+   explicit mapped_file(const char* path)
+   {
+      const int fd = open(path, O_RDONLY);
+      struct stat file_stat;
+      if (fd < 0 || fstat(fd, &file_stat) != 0) {
+         std::cerr << "Could not open " << path << ": " << std::strerror(errno) << '\n';
+         std::exit(1);
+      }
+      size_ = static_cast<std::size_t>(file_stat.st_size);
+      // An empty file can't be mapped
+      if (size_ > 0) {
+         data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (data_ == MAP_FAILED) {
+            std::cerr << "Could not map " << path << ": " << std::strerror(errno) << '\n';
+            std::exit(1);
+         }
+         madvise(data_, size_, MADV_SEQUENTIAL);
+      }
+      close(fd);
+   }
+
+   mapped_file(const mapped_file&) = delete;
+   mapped_file& operator=(const mapped_file&) = delete;
+
+   ~mapped_file()
+   {
+      if (size_ > 0) {
+         munmap(data_, size_);
+      }
+   }
+
+   std::span<const std::uint8_t> data() const noexcept { return {static_cast<const std::uint8_t*>(data_), size_}; }
+
+   // Drops the whole pages before offset end from memory, which mustn't be read again
+   void release(std::size_t end) noexcept
+   {
+      static const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      end = std::min(end, size_);
+      end -= end % page_size;
+      if (end > released_) {
+         madvise(static_cast<std::uint8_t*>(data_) + released_, end - released_, MADV_DONTNEED);
+         released_ = end;
+      }
+   }
+
+private:
+   void* data_ = nullptr;
+   std::size_t size_ = 0;
+   std::size_t released_ = 0;
+};
+
+#endif // MAPPED_FILE_HPP